@@ -0,0 +1,32 @@
+#
+#   This file is part of QSTLink2.
+#
+#   QSTLink2 is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   QSTLink2 is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+
+# Headless flashing tool, no QtGui/QtWidgets.
+
+include(../common.pri)
+include(../core/core.pri)
+
+QT = core xml network
+
+TEMPLATE = app
+TARGET = qstlink2-cli
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += ../src/cli_main.cpp
+
+target.path = /usr/bin
+INSTALLS += target
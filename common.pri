@@ -0,0 +1,33 @@
+#
+#   This file is part of QSTLink2.
+#
+#   QSTLink2 is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   QSTLink2 is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+
+# Settings shared by the core library and the applications.
+
+VERSION = 1.3.0
+
+VERSTR = '\\"$${VERSION}\\"'  # place quotes around the version string
+DEFINES += __QSTL_VER__=\"$${VERSTR}\" # create a VER macro containing the version string
+
+win32:CONFIG += winusb
+# The QtUsb headers are also seen by the applications, they need the same backend define.
+winusb: DEFINES += QWINUSB
+
+INCLUDEPATH += $$PWD/inc $$PWD/QtUsb/src/usb
+
+# Per-transfer trace output is compiled out of release builds, CONFIG+=trace keeps it.
+CONFIG(release, debug|release):!trace: DEFINES += QSTL_NO_TRACE
+
+windows: DEFINES += WINDOWS
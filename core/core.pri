@@ -0,0 +1,30 @@
+#
+#   This file is part of QSTLink2.
+#
+#   QSTLink2 is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   QSTLink2 is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+
+# Links an application with the core library, its libusb/WinUSB dependencies come from its .prl file.
+
+CONFIG += link_prl
+
+CORE_DIR = $$OUT_PWD/../core
+win32 {
+    CONFIG(debug, debug|release): CORE_DIR = $$CORE_DIR/debug
+    else: CORE_DIR = $$CORE_DIR/release
+}
+win32:!win32-g++: CORE_LIB = $$CORE_DIR/qstlink2core.lib
+else: CORE_LIB = $$CORE_DIR/libqstlink2core.a
+
+LIBS += -L$$CORE_DIR -lqstlink2core
+PRE_TARGETDEPS += $$CORE_LIB
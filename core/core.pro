@@ -0,0 +1,67 @@
+#
+#   This file is part of QSTLink2.
+#
+#   QSTLink2 is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   QSTLink2 is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+
+# Probe, device database, loaders and transfers, without any GUI dependency.
+
+include(../common.pri)
+
+QT = core xml network
+
+TEMPLATE = lib
+TARGET = qstlink2core
+CONFIG += staticlib create_prl
+
+INCLUDEPATH += $$OUT_PWD
+
+# Built-in device list, compiled from res/devices.xml.
+isEmpty(PYTHON) {
+    win32: PYTHON = python
+    else: PYTHON = python3
+}
+DEVICES_XML = ../res/devices.xml
+devices_table.input = DEVICES_XML
+devices_table.output = $$OUT_PWD/devices_table.h
+devices_table.commands = $$PYTHON $$PWD/../res/compile_devices.py ${QMAKE_FILE_IN} ${QMAKE_FILE_OUT}
+devices_table.depends = $$PWD/../res/compile_devices.py
+devices_table.variable_out = HEADERS
+devices_table.CONFIG += target_predeps no_link
+QMAKE_EXTRA_COMPILERS += devices_table
+
+SOURCES += ../src/stlinkv2.cpp \
+           ../src/devices.cpp \
+           ../src/transferthread.cpp \
+           ../src/loader.cpp \
+           ../src/image.cpp \
+           ../src/gang.cpp \
+           ../src/probestats.cpp \
+           ../src/daemon.cpp \
+           ../src/cli.cpp
+
+HEADERS += ../inc/stlinkv2.h \
+           ../inc/devices.h \
+           ../inc/transferthread.h \
+           ../inc/compat.h \
+           ../inc/loader.h \
+           ../inc/image.h \
+           ../inc/gang.h \
+           ../inc/probestats.h \
+           ../inc/daemon.h \
+           ../inc/cli.h
+
+include(../QtUsb/src/usb/files.pri)
+
+# Q_INIT_RESOURCE(loaders) in the applications.
+RESOURCES += ../loaders/loaders.qrc
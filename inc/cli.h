@@ -0,0 +1,102 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef CLI_H
+#define CLI_H
+
+#include <QObject>
+#include <QString>
+#include <QCommandLineParser>
+#include "stlinkv2.h"
+#include "devices.h"
+#include "transferthread.h"
+#include "compat.h"
+
+/**
+ * @brief Command line mode, shared by qstlink2 --cli and qstlink2-cli.
+ *
+ * Only needs a QCoreApplication. The transfers are waited for in a local event loop
+ * left on the thread's finished() signal.
+ */
+class Cli : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param parent
+     */
+    explicit Cli(QObject *parent = 0);
+    /**
+     * @brief Destructor, disconnects the probe.
+     *
+     */
+    ~Cli();
+    /**
+     * @brief Adds the command line mode options, common to both applications.
+     *
+     * @param parser
+     */
+    static void addOptions(QCommandLineParser *parser);
+    /**
+     * @brief Applies --quiet/--debug and installs the timestamped message handler.
+     *
+     * @param parser
+     */
+    static void setupLogging(const QCommandLineParser &parser);
+    /**
+     * @brief Runs the actions selected on the command line.
+     *
+     * @param parser Processed parser
+     * @return int exit code, 0 on success
+     */
+    int exec(const QCommandLineParser &parser);
+
+private slots:
+    /**
+     * @brief
+     *
+     * @param s
+     */
+    void log(const QString &s);
+
+private:
+    /**
+     * @brief Opens the first ST-Link V2 / Nucleo probe and identifies its target.
+     *
+     * @return bool
+     */
+    bool connect();
+    /**
+     * @brief Starts the transfer thread and waits for it to finish.
+     *
+     * @return bool transfer result
+     */
+    bool runTransfer();
+    /**
+     * @brief Prints the probe statistics, and writes them as JSON when asked to.
+     *
+     * @param path JSON file, may be empty
+     */
+    void dumpStats(const QString &path);
+
+    DeviceInfoList mDevices; /**< device database */
+    stlinkv2 *mStlink; /**< probe */
+    transferThread *mTfThread; /**< worker */
+};
+
+#endif // CLI_H
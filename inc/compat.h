@@ -17,9 +17,25 @@ This file is part of QSTLink2.
 #ifndef COMPAT_H
 #define COMPAT_H
 #include <stdio.h>
-#include <QApplication>
+#include <QCoreApplication>
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(lcTrace)
+
+/*
+ * Per-transfer debug output, "qstlink2.trace" category, off unless enabled by --debug or QT_LOGGING_RULES.
+ * The arguments are only evaluated when the category is enabled, and nothing is left of it when
+ * QSTL_NO_TRACE is defined (release builds, unless CONFIG+=trace).
+ */
+#ifdef QSTL_NO_TRACE
+#define qTrace(...) \
+    while (false)   \
+    QMessageLogger().noDebug()
+#else
+#define qTrace(...) qCDebug(lcTrace, __VA_ARGS__)
+#endif
 
 #define PrintError() qCritical("In %s, at %s:%d", Q_FUNC_INFO, __FILE__, __LINE__)
-#define PrintFuncName() qDebug() << "{" << Q_FUNC_INFO << "}"
+#define PrintFuncName() qTrace() << "{" << Q_FUNC_INFO << "}"
 
 #endif // COMPAT_H
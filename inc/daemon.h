@@ -0,0 +1,187 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include <QQueue>
+#include <QPointer>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QJsonObject>
+#include <QJsonValue>
+#include "stlinkv2.h"
+#include "devices.h"
+#include "transferthread.h"
+#include "compat.h"
+
+/**
+ * @brief Keeps the probes open and runs the jobs posted on a local socket.
+ *
+ * Requests and replies are JSON objects, one per line. Every request may carry an "id",
+ * echoed in its replies.
+ *
+ * - {"cmd": "list"} lists the probes: {"probes": [{"probe", "name", "device", "chip_id", "flash_size"}]}
+ * - {"cmd": "rescan"} reopens the probes and lists them, refused while jobs are pending
+ * - {"cmd": "write", "probe", "path", "verify", "diff", "compress", "vpp"} programs a file
+ * - {"cmd": "verify", "probe", "path"} compares the flash with a file
+ * - {"cmd": "read", "probe", "path"} saves the flash to a file
+ * - {"cmd": "blank", "probe"} checks that the flash is erased
+ *
+ * Jobs run in order on each probe, different probes work concurrently. A job is answered by a
+ * "queued" event, then "started", "progress" and "log" events, and a "done" event with its "result".
+ * Bad requests get an "error" event.
+ */
+class Daemon : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param parent
+     */
+    explicit Daemon(QObject *parent = 0);
+    /**
+     * @brief Destructor, waits for the running jobs and disconnects the probes.
+     *
+     */
+    ~Daemon();
+    /**
+     * @brief Opens the probes and starts listening.
+     *
+     * @param name Local socket name
+     * @param jtag Use JTAG instead of SWD
+     * @return bool false if the socket can't be created
+     */
+    bool listen(const QString &name, bool jtag);
+
+private slots:
+    /**
+     * @brief
+     *
+     */
+    void newClient();
+    /**
+     * @brief Handles the complete request lines of a client.
+     *
+     */
+    void clientData();
+    /**
+     * @brief Drops the queued jobs of a client.
+     *
+     */
+    void clientGone();
+    /**
+     * @brief
+     *
+     * @param p
+     */
+    void jobProgress(quint32 p);
+    /**
+     * @brief
+     *
+     * @param s
+     */
+    void jobLog(const QString &s);
+    /**
+     * @brief Reports the result and starts the next job of the probe.
+     *
+     */
+    void jobFinished();
+
+private:
+    /**
+     * @brief A posted job.
+     *
+     */
+    struct Job {
+        QPointer<QLocalSocket> client; /**< requester, null once disconnected */
+        QJsonValue id; /**< request id */
+        QString cmd; /**< write, verify, read or blank */
+        QString path; /**< file */
+        bool verify; /**< verify after writing */
+        bool diff; /**< only rewrite what differs */
+        bool compress; /**< run-length encoded transfer */
+        bool vpp; /**< external VPP */
+    };
+    /**
+     * @brief Probe, its worker and its jobs.
+     *
+     */
+    struct Probe {
+        QString name; /**< bus and port */
+        stlinkv2 *stlink; /**< probe */
+        transferThread *thread; /**< worker */
+        QQueue<Job> jobs; /**< pending jobs, the head one runs while busy */
+        bool busy; /**< a job is running */
+    };
+    /**
+     * @brief
+     *
+     * @param client
+     * @param req
+     */
+    void handle(QLocalSocket *client, const QJsonObject &req);
+    /**
+     * @brief Sends a reply line, tagged with the request id.
+     *
+     * @param client May be null
+     * @param id
+     * @param msg
+     */
+    void reply(QLocalSocket *client, const QJsonValue &id, QJsonObject msg);
+    /**
+     * @brief
+     *
+     * @return QJsonObject probe list reply
+     */
+    QJsonObject probeList() const;
+    /**
+     * @brief Starts the head job of a probe, if idle.
+     *
+     * @param probe
+     */
+    void startNext(Probe &probe);
+    /**
+     * @brief
+     *
+     * @param thread
+     * @return int probe index, -1 if unknown
+     */
+    int probeOf(QObject *thread) const;
+    /**
+     * @brief
+     *
+     * @return int number of probes ready
+     */
+    int openProbes();
+    /**
+     * @brief
+     *
+     */
+    void closeProbes();
+
+    DeviceInfoList mDevices; /**< device database */
+    QLocalServer *mServer; /**< job socket */
+    QList<Probe> mProbes; /**< connected probes */
+    bool mJtag; /**< probes use JTAG */
+};
+
+#endif // DAEMON_H
@@ -24,8 +24,79 @@ This file is part of QSTLink2.
 #include <QString>
 #include <QVector>
 #include <QMap>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QStringList>
 #include "compat.h"
 
+typedef QPair<quint32, quint32> FlashRange; /**< Flash address and size */
+
+/**
+ * @brief Named value of the built-in device table.
+ *
+ */
+struct DeviceValue {
+    const char *key; /**< devices.xml tag */
+    quint32 value; /**< value */
+};
+
+/**
+ * @brief Device of the built-in table, generated from devices.xml at build time.
+ *
+ */
+struct DeviceEntry {
+    quint32 chip_id; /**< ST's chip ID, the table is sorted on it */
+    const char *type; /**< device type */
+    const char *loader; /**< loader bin file */
+    const DeviceValue *values; /**< values overriding the defaults */
+    int value_count; /**< number of values */
+    const quint32 *sectors; /**< sector sizes, 0 for page based devices */
+    int sector_count; /**< number of sectors */
+};
+
+/**
+ * @brief Typed device values, kept in sync with the DeviceInfo map.
+ *
+ */
+struct DeviceDescriptor {
+    quint32 chip_id; /**< ST's chip ID */
+    quint32 flash_base; /**< flash start address */
+    quint32 flash_size; /**< flash size in KB */
+    quint32 flash_size_reg; /**< flash size register address */
+    quint32 flash_page_size; /**< page size, 0 for sector based devices */
+    quint32 flash_bank_size; /**< bank size, 0 for a single bank */
+    quint32 flash_erased; /**< erased byte value */
+    quint32 flash_int_reg; /**< flash interface base address */
+    quint32 sr_offset; /**< status register offset */
+    quint32 cr_offset; /**< control register offset */
+    quint32 keyr_offset; /**< key register offset */
+    quint32 sr_bsy; /**< busy bit */
+    quint32 cr_lock; /**< lock bit */
+    quint32 sram_base; /**< SRAM start address */
+    quint32 buffer_size; /**< SRAM used by the loader and its buffer */
+    quint32 loader_clock; /**< loader clock profile */
+
+    /**
+     * @brief
+     *
+     * @return quint32 flash status register address
+     */
+    quint32 flashSR() const { return flash_int_reg + sr_offset; }
+    /**
+     * @brief
+     *
+     * @return quint32 flash control register address
+     */
+    quint32 flashCR() const { return flash_int_reg + cr_offset; }
+    /**
+     * @brief
+     *
+     * @return quint32 flash key register address
+     */
+    quint32 flashKEYR() const { return flash_int_reg + keyr_offset; }
+};
+
 /**
  * @brief
  *
@@ -54,26 +125,25 @@ public:
      */
     quint32 operator[](QString k) const { return mMap[k]; }
     /**
-     * @brief
-     *
-     * @param k
-     * @return quint32 &operator
-     */
-    quint32 &operator[](QString k) { return mMap[k]; }
-    /**
-     * @brief
+     * @brief Looks up any value by name, the known ones are faster through desc().
      *
      * @param k
      * @return quint32
      */
     quint32 value(QString k) { return mMap.value(k); }
     /**
-     * @brief
+     * @brief Sets a value, and its descriptor field if it has one.
      *
      * @param k
      * @param v
      */
-    void insert(QString k, quint32 v) { mMap.insert(k, v); }
+    void insert(QString k, quint32 v);
+    /**
+     * @brief Typed values, resolved when they are inserted.
+     *
+     * @return const DeviceDescriptor &
+     */
+    const DeviceDescriptor &desc() const { return mDesc; }
     /**
      * @brief
      *
@@ -87,10 +157,49 @@ public:
      * @return QString
      */
     QString repr(void) const;
+    /**
+     * @brief Lists the erase units (pages or sectors) covering a flash range.
+     *
+     * @param from Start address
+     * @param to End address, excluded
+     * @return QList<FlashRange> empty if the device has no flash geometry
+     */
+    QList<FlashRange> eraseUnits(quint32 from, quint32 to) const;
+    /**
+     * @brief Lists the erase units covering a list of sorted ranges, each unit once.
+     *
+     * @param ranges
+     * @return QList<FlashRange> empty if the device has no flash geometry
+     */
+    QList<FlashRange> eraseUnits(const QList<FlashRange> &ranges) const;
+    /**
+     * @brief Lists the flash banks, needs flash_size.
+     *
+     * @return QList<FlashRange> a single bank unless flash_bank_size is set
+     */
+    QList<FlashRange> banks() const;
+    /**
+     * @brief Erase units covering the ranges, with fully covered banks replacing their units.
+     *
+     * @param ranges Sorted ranges to program
+     * @return QList<FlashRange> empty if the device has no flash geometry
+     */
+    QList<FlashRange> erasePlan(const QList<FlashRange> &ranges) const;
+    /**
+     * @brief Sector number of the sector starting at addr, as FLASH_CR SNB expects it.
+     *
+     * Numbers restart at 16 in the second bank when flash_bank_size is set.
+     *
+     * @param addr Sector start address
+     * @return int -1 if no sector starts there
+     */
+    int sectorNumber(quint32 addr) const;
     QString mType; /**< device type */
     QString mLoaderFile; /**< associated loader bin file */
+    QList<quint32> mSectors; /**< sector sizes from the flash base, the last one repeats */
 private:
     QMap<QString, quint32> mMap; /**< values map */
+    DeviceDescriptor mDesc; /**< typed copy of the known values */
 };
 
 /**
@@ -129,9 +238,26 @@ public:
     DeviceInfo *mCurDevice; /**< ptr to current device */
 
 private:
+    /**
+     * @brief Loads a devices.xml file instead of the built-in table.
+     *
+     * @param file Opened file
+     * @return bool false if it can't be parsed
+     */
+    bool loadXml(QFile *file);
+    /**
+     * @brief Builds the description of a built-in table entry.
+     *
+     * @param entry
+     * @return DeviceInfo owned by the list
+     */
+    DeviceInfo *fromTable(const DeviceEntry &entry);
+
     QDomDocument *mDoc; /**< XML document */
     bool mLoaded; /**< loaded status */
-    QVector<DeviceInfo *> mDevices; /**< devices list */
+    bool mBuiltin; /**< devices come from the built-in table */
+    QVector<DeviceInfo *> mDevices; /**< devices list, from the XML file or built on demand */
+    QHash<quint32, DeviceInfo *> mIndex; /**< devices by chip ID */
     DeviceInfo *mDefaultDevice; /**< default devices (to copy default values from) */
 };
 
@@ -0,0 +1,99 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GANG_H
+#define GANG_H
+
+#include <QObject>
+#include <QString>
+#include <QList>
+#include "stlinkv2.h"
+#include "devices.h"
+#include "transferthread.h"
+#include "compat.h"
+
+/**
+ * @brief Programs several boards at once, one probe and transfer thread per board.
+ *
+ */
+class Gang : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param devices Device database, each probe gets its own copy of its entry
+     * @param parent
+     */
+    explicit Gang(DeviceInfoList *devices, QObject *parent = 0);
+    /**
+     * @brief Destructor, disconnects the probes.
+     *
+     */
+    ~Gang();
+    /**
+     * @brief Connects to every attached probe and identifies its target.
+     *
+     * Probes that can't be opened or whose target is unknown are skipped.
+     *
+     * @param jtag Use JTAG instead of SWD
+     * @return int number of probes ready
+     */
+    int open(bool jtag);
+    /**
+     * @brief
+     *
+     */
+    void close();
+    /**
+     * @brief Programs the same file on all the probes concurrently.
+     *
+     * @param path
+     * @param verify
+     * @param diff
+     * @param compress
+     * @param vpp External VPP applied on every board
+     * @return int number of boards that failed
+     */
+    int send(const QString &path, bool verify, bool diff, bool compress, bool vpp);
+    /**
+     * @brief Enters debug mode and binds the target description.
+     *
+     * The probe gets its own copy of its device entry, to be deleted with it.
+     *
+     * @param devices Device database
+     * @param stlink Connected probe
+     * @param jtag
+     * @return bool false if the target is unknown
+     */
+    static bool setupProbe(DeviceInfoList *devices, stlinkv2 *stlink, bool jtag);
+
+private:
+    /**
+     * @brief Probe and its worker.
+     *
+     */
+    struct Probe {
+        QString name; /**< bus and port */
+        stlinkv2 *stlink; /**< probe */
+        transferThread *thread; /**< worker */
+    };
+    DeviceInfoList *mDevices; /**< device database */
+    QList<Probe> mProbes; /**< connected probes */
+};
+
+#endif // GANG_H
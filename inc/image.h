@@ -0,0 +1,227 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <QObject>
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+#include <QDebug>
+#include <QList>
+#include "compat.h"
+#include "devices.h"
+
+/**
+ * @brief Contiguous part of an image.
+ *
+ */
+struct ImageSegment {
+    quint32 addr; /**< flash address */
+    QByteArray data; /**< contents, a view on the mapping for binary and ELF files */
+};
+
+/**
+ * @brief Firmware image to program or verify, mapped in memory.
+ *
+ * Raw binaries are a single segment at the given base address. ELF (PT_LOAD segments),
+ * Intel HEX and Motorola S-record files can hold several segments.
+ */
+class ImageSource : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Image file formats
+     *
+     */
+    enum Format {
+        FormatBin, /**< Raw binary */
+        FormatElf, /**< 32 bit little endian ELF */
+        FormatHex, /**< Intel HEX */
+        FormatSrec /**< Motorola S-record */
+    };
+    /**
+     * @brief Constructor
+     *
+     * @param parent
+     */
+    explicit ImageSource(QObject *parent = 0);
+    /**
+     * @brief Destructor, unmaps the image.
+     *
+     */
+    ~ImageSource();
+    /**
+     * @brief Opens, maps and parses a file, read in memory if it can't be mapped.
+     *
+     * The format is taken from the extension, ELF files are also detected by their magic.
+     * Segments are widened to whole program words, those sharing a word are merged.
+     *
+     * @param path
+     * @param base Address of raw binaries
+     * @param align Program word size, a power of two
+     * @param fill Value of the padding and the gaps in merged segments, the erased flash value
+     * @return bool false if the file can't be read or parsed
+     */
+    bool open(const QString &path, quint32 base, quint32 align = 1, char fill = (char)0xFF);
+    /**
+     * @brief
+     *
+     */
+    void close();
+    /**
+     * @brief
+     *
+     * @return Format
+     */
+    Format format() const;
+    /**
+     * @brief
+     *
+     * @return qint64 number of data bytes, gaps excluded
+     */
+    qint64 size() const;
+    /**
+     * @brief
+     *
+     * @return quint32 lowest address
+     */
+    quint32 start() const;
+    /**
+     * @brief
+     *
+     * @return quint32 address after the last byte
+     */
+    quint32 end() const;
+    /**
+     * @brief Address ranges holding data, sorted and merged.
+     *
+     * @return QList<FlashRange>
+     */
+    QList<FlashRange> ranges() const;
+    /**
+     * @brief Returns image data without copying it, clipped to the end of its segment.
+     *
+     * The data is only valid until the image is closed.
+     *
+     * @param addr
+     * @param len
+     * @return QByteArray empty if there is no data at addr
+     */
+    QByteArray view(quint32 addr, qint64 len) const;
+    /**
+     * @brief Copies an address range, gaps filled.
+     *
+     * @param addr
+     * @param len
+     * @param fill
+     * @return QByteArray
+     */
+    QByteArray extract(quint32 addr, quint32 len, char fill = (char)0xFF) const;
+
+private:
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool parseElf();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool parseHex();
+    /**
+     * @brief
+     *
+     * @return bool
+     */
+    bool parseSrec();
+    /**
+     * @brief Adds data, extending the last segment when contiguous.
+     *
+     * @param addr
+     * @param data
+     */
+    void addData(quint32 addr, const QByteArray &data);
+    /**
+     * @brief Sorts and merges segments, rejects overlaps, then pads them to mAlign.
+     *
+     * @return bool
+     */
+    bool finalize();
+
+    QFile mFile; /**< image file */
+    uchar *mData; /**< mapping, or mBuffer data */
+    QByteArray mBuffer; /**< file contents when mapping is not possible */
+    qint64 mFileSize; /**< file size */
+    Format mFormat; /**< file format */
+    QList<ImageSegment> mSegments; /**< sorted segments */
+    quint32 mAlign; /**< program word size */
+    char mFill; /**< padding value */
+};
+
+/**
+ * @brief File written at random offsets through a preallocated mapping.
+ *
+ */
+class ImageSink : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Constructor
+     *
+     * @param parent
+     */
+    explicit ImageSink(QObject *parent = 0);
+    /**
+     * @brief Destructor, flushes and unmaps the file.
+     *
+     */
+    ~ImageSink();
+    /**
+     * @brief Creates or truncates the file and allocates its final size.
+     *
+     * @param path
+     * @param size
+     * @return bool
+     */
+    bool open(const QString &path, qint64 size);
+    /**
+     * @brief
+     *
+     */
+    void close();
+    /**
+     * @brief Copies data at the given offset, clipped to the file size.
+     *
+     * @param offset
+     * @param buf
+     * @return bool
+     */
+    bool write(qint64 offset, const QByteArray &buf);
+
+private:
+    QFile mFile; /**< output file */
+    uchar *mData; /**< mapping, 0 when falling back to plain writes */
+    qint64 mSize; /**< file size */
+};
+
+#endif // IMAGE_H
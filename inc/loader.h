@@ -10,16 +10,95 @@
 
 namespace Loader {
 
+const quint32 PROGRAM_STEP = 4; /**< Bytes programmed at a time, images are padded to it */
+
 namespace Addr {
 
 const quint32 SRAM = 0x20000000; /**< TODO: describe */
-const quint32 PARAMS = 0x200007D0; /**< TODO: describe */
+const quint32 LEGACY_PARAMS = 0x200007D0; /**< Parameters of loaders without a header */
 const quint32 OFFSET_DEST = 0x00; /**< TODO: describe */
 const quint32 OFFSET_LEN = 0x04; /**< TODO: describe */
 const quint32 OFFSET_STATUS = 0x08; /**< TODO: describe */
 const quint32 OFFSET_POS = 0x0C; /**< TODO: describe */
 const quint32 OFFSET_TEST = 0x10; /**< TODO: describe */
-const quint32 BUFFER = 0x20000800; /**< TODO: describe */
+const quint32 OFFSET_VERSION = 0x14; /**< Loader magic and capabilities */
+const quint32 OFFSET_CMD = 0x18; /**< Command run after the breakpoint */
+const quint32 OFFSET_OWNER = 0x1C; /**< Slot ownership flags, one word per slot */
+const quint32 OFFSET_SEQ = 0x24; /**< Mailbox, a new sequence number posts a job */
+const quint32 OFFSET_ACK = 0x28; /**< Sequence number of the last completed job */
+const quint32 OFFSET_RESULT = 0x2C; /**< Job result */
+const quint32 LEGACY_BUFFER = 0x20000800; /**< Buffer of loaders without a header */
+const quint32 MIN_BUFFER = 0x200; /**< Smallest buffer left after the loader */
+}
+namespace Header {
+
+const quint32 MAGIC = 0x514C4844; /**< Marks a loader image carrying its layout */
+const int OFFSET_MAGIC = 0x04; /**< After the branch to main */
+const int OFFSET_PARAMS = 0x08; /**< Parameters address of this build */
+const int OFFSET_BUFFER = 0x0C; /**< Buffer address of this build */
+const int SIZE = 0x10; /**< Header length */
+}
+namespace Cmd {
+
+const quint32 PROGRAM = 0; /**< Program DEST/LEN from the buffer (legacy) */
+const quint32 STREAM = 1; /**< Program chunks from two alternating slots */
+const quint32 MAILBOX = 2; /**< Keep running and execute posted jobs */
+const quint32 EXIT = 3; /**< Leave the mailbox, back to the breakpoint */
+const quint32 CRC = 4; /**< CRC32 of DEST/LEN into RESULT */
+const quint32 HASH = 5; /**< CRC32 of LEN address/length pairs in the buffer */
+const quint32 BLANK = 6; /**< First non-erased address of DEST/LEN into RESULT */
+const quint32 ERASE = 7; /**< Erase LEN address/length pairs in the buffer, programming stops erasing */
+const quint32 PSIZE = 8; /**< Program and erase LEN bytes at a time, RESULT holds the size applied */
+const quint32 CLOCK = 9; /**< Switch to the LEN clock profile until the mailbox is left */
+}
+namespace Caps {
+
+const quint32 MAGIC = 0x514C0000; /**< Set by loaders speaking the extended protocol */
+const quint32 MAGIC_MASK = 0xFFFF0000; /**< Magic part of the version word */
+const quint32 STREAM = (1 << 0); /**< Double-buffered streaming */
+const quint32 MAILBOX = (1 << 1); /**< Run-to-completion mailbox */
+const quint32 CRC = (1 << 2); /**< On-target CRC32 */
+const quint32 HASH = (1 << 3); /**< CRC32 of a list of ranges */
+const quint32 RLE = (1 << 4); /**< Run-length encoded stream chunks */
+const quint32 SKIP = (1 << 5); /**< Erase only chunks, erased words are not programmed */
+const quint32 BLANK = (1 << 6); /**< On-target blank check, blank units are not erased again */
+const quint32 ERASE = (1 << 7); /**< Erase plan */
+const quint32 BACKGROUND = (1 << 8); /**< Background erase of a bank with its own controller */
+const quint32 PSIZE = (1 << 9); /**< Program parallelism set by the host */
+const quint32 CLOCK = (1 << 10); /**< Clock profile set by the host */
+const quint32 GEOMETRY = (1 << 11); /**< Erase step in RESULT at startup, 0 for whole sectors */
+const quint32 SECTORS = (1 << 12); /**< Erase plan ranges carry their sector number */
+}
+namespace Chunk {
+
+const quint32 HEADER_SIZE = 8; /**< Destination and length words before the data */
+const quint8 SLOTS = 2; /**< Number of buffer slots in stream mode */
+const quint32 RLE = (1u << 31); /**< Length flag, the chunk data is run-length encoded */
+const quint32 ERASE = (1u << 30); /**< Length flag, erase only, the chunk has no data */
+const quint32 ERASE_BANK = (1u << 31); /**< Erase plan length flag, the range is a whole bank */
+const quint32 ERASE_BACKGROUND = (1u << 30); /**< Erase plan length flag, erased while the following jobs run */
+const quint32 ERASE_SECTOR = (1u << 29); /**< Erase plan length flag, the range is the sector numbered below */
+const quint8 ERASE_SNB_SHIFT = 24; /**< Sector number position in an erase plan length */
+const quint32 ERASE_SNB_MAX = 0x1F; /**< Highest sector number the length can hold */
+const quint32 ERASE_LEN_MASK = 0x00FFFFFF; /**< Erase plan length without its flags and sector number */
+const int ERASE_QUEUE = 16; /**< Background ranges the loader can hold */
+const quint8 RLE_REPEAT = 0x80; /**< Control bytes from here encode a repeated byte */
+const quint8 RLE_MIN_RUN = 3; /**< Shortest repeat, shorter ones are sent as literals */
+const quint8 RLE_MAX_RUN = 0xFF - RLE_REPEAT + RLE_MIN_RUN; /**< Longest repeat */
+const quint8 RLE_MAX_LITERAL = RLE_REPEAT; /**< Longest literal run */
+}
+namespace Clock {
+
+const quint32 RESET = 0; /**< Clock found at startup */
+const quint32 FAST = 1; /**< HSI and PLL at the highest frequency safe for the family */
+}
+namespace Timeout {
+
+const quint32 STARTUP = 2000; /**< Loader start up to its first breakpoint, ms */
+const quint32 CHUNK = 10000; /**< Erasing and programming a legacy chunk, ms */
+const quint32 PROGRESS = 50; /**< Progress refresh while waiting for a chunk, ms */
+const quint32 WRITE_KB = 1000; /**< Erasing and programming 1KB on the slowest family (L1 word writes), ms */
+const quint32 READ_KB = 10; /**< CRC, hash or blank check of 1KB at the reset clock, ms */
 }
 namespace Masks {
 
@@ -30,6 +109,26 @@ const quint32 DEL = (1 << 3); /**< TODO: describe */
 const quint32 VEREN = (1 << 4); /**< TODO: describe */
 const quint32 ERR = (1 << 15); /**< TODO: describe */
 }
+
+/**
+ * @brief CRC32 as computed by the STM32 CRC unit, poly 0x04C11DB7 over little endian words.
+ *
+ * A trailing partial word is padded with 0xFF, as the loader does.
+ *
+ * @param data
+ * @return quint32
+ */
+quint32 crc32(const QByteArray &data);
+/**
+ * @brief Run-length encodes a chunk the way the loader decodes it.
+ *
+ * Control bytes below Chunk::RLE_REPEAT are followed by ctl + 1 literal bytes,
+ * the others by one byte repeated ctl - RLE_REPEAT + RLE_MIN_RUN times.
+ *
+ * @param data
+ * @return QByteArray
+ */
+QByteArray rleEncode(const QByteArray &data);
 }
 
 /**
@@ -59,6 +158,18 @@ public:
      * @return QByteArray
      */
     QByteArray &refData(void);
+    /**
+     * @brief Parameters address, from the image header or the legacy one.
+     *
+     * @return quint32
+     */
+    quint32 params(void) const;
+    /**
+     * @brief Buffer address, from the image header or the legacy one.
+     *
+     * @return quint32
+     */
+    quint32 buffer(void) const;
 
 signals:
 
@@ -66,6 +177,8 @@ public slots:
 
 private:
     QByteArray mData; /**< TODO: describe */
+    quint32 mParams; /**< Parameters address of the loaded image */
+    quint32 mBuffer; /**< Buffer address of the loaded image */
 };
 
 #endif // LOADER_H
@@ -126,6 +126,11 @@ public slots:
      *
      */
     void eraseFlash();
+    /**
+     * @brief Checks that the whole flash is erased.
+     *
+     */
+    void blankCheck();
     /**
      * @brief
      *
@@ -0,0 +1,103 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PROBESTATS_H
+#define PROBESTATS_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QJsonObject>
+#include "compat.h"
+
+/**
+ * @brief Counts, bytes moved and latency histogram of the probe commands, per opcode.
+ *
+ * The latency of a command runs from its packet being sent to the end of its last
+ * data or response transfer.
+ */
+class ProbeStats : public QObject
+{
+    Q_OBJECT
+public:
+    static const int BUCKETS = 10; /**< Latency histogram buckets, the last one is unbounded */
+    /**
+     * @brief Counters of one opcode.
+     *
+     */
+    struct Entry {
+        quint32 count; /**< commands sent */
+        quint64 bytes_out; /**< command packets and data phases */
+        quint64 bytes_in; /**< responses */
+        qint64 total_ns; /**< summed latency */
+        qint64 max_ns; /**< slowest command */
+        quint32 histogram[BUCKETS]; /**< commands per latency bucket */
+    };
+    /**
+     * @brief Constructor
+     *
+     * @param parent
+     */
+    explicit ProbeStats(QObject *parent = 0);
+    /**
+     * @brief
+     *
+     */
+    void clear();
+    /**
+     * @brief Accounts for one completed command.
+     *
+     * @param cmd Command packet, only its opcode bytes are used
+     * @param bytes_out
+     * @param bytes_in
+     * @param nsecs Latency
+     */
+    void record(const QByteArray &cmd, qint64 bytes_out, qint64 bytes_in, qint64 nsecs);
+    /**
+     * @brief Command packet key, the sub-command is part of it for debug and DFU commands.
+     *
+     * @param cmd
+     * @return quint16
+     */
+    static quint16 opcode(const QByteArray &cmd);
+    /**
+     * @brief
+     *
+     * @param opcode
+     * @return QString command name, its hex value when unknown
+     */
+    static QString opcodeName(quint16 opcode);
+    /**
+     * @brief Human readable table, one line per opcode and its latency histogram.
+     *
+     * @return QStringList
+     */
+    QStringList summary() const;
+    /**
+     * @brief
+     *
+     * @return QJsonObject
+     */
+    QJsonObject toJson() const;
+
+private:
+    static const quint32 BOUNDS[BUCKETS - 1]; /**< Upper bounds of the histogram buckets, us */
+    QMap<quint16, Entry> mEntries; /**< counters by opcode */
+};
+
+#endif // PROBESTATS_H
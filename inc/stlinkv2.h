@@ -21,13 +21,17 @@ This file is part of QSTLink2.
 #include <QThread>
 #include <QFile>
 #include <QByteArray>
+#include <QQueue>
 #include <QtEndian>
+#include <functional>
+#include <QElapsedTimer>
 #include "qusbdevice.h"
 #include "qusbinfo.h"
 #include "qusbendpoint.h"
 #include "compat.h"
 #include "devices.h"
 #include "loader.h"
+#include "probestats.h"
 
 const quint16 USB_ST_VID = 0x0483; /**< USB Vid */
 const quint16 USB_STLINK_PID = 0x3744; /**< USB Pid for stlink v1 */
@@ -64,6 +68,7 @@ const quint8 DFUExit = 0x07; /**< TODO: describe */
 const quint8 DFUGetVersion = 0x08; /**< TODO: describe */
 const quint8 GetCurrentMode = 0xF5; /**< TODO: describe */
 const quint8 Reset = 0xF7; /**< TODO: describe */
+const quint8 GetTargetVoltage = 0xF7; /**< ADC readings of the 1.2V reference and of half the target VDD */
 
 namespace Dbg {
 const quint8 EnterJTAG = 0x00; /**< TODO: describe */
@@ -99,6 +104,71 @@ const quint8 ReadAllRegs = 0x3A; /**< All registers fetched at once */
 const quint8 HardReset = 0x3C; /**< NRST pull down */
 }
 }
+
+/**
+ * @brief A queued probe command, its data phase and expected response.
+ *
+ */
+struct Transaction {
+    QByteArray cmd; /**< Command packet, padded when sent */
+    QByteArray data; /**< Data phase sent right after the command, may be empty */
+    quint32 resp_len; /**< Response length, 0 if the command has none */
+    std::function<void(const QByteArray &)> done; /**< Called with the response once read, may be empty */
+};
+/**
+ * @brief A target memory access of a stlinkv2::transfer() batch.
+ *
+ */
+struct MemOp {
+    bool is_write; /**< Writes data if set, reads len bytes into data otherwise */
+    quint32 addr; /**< Word aligned address */
+    quint32 len; /**< Length, the data size for writes */
+    QByteArray data; /**< Data to write, or data read */
+
+    /**
+     * @brief
+     *
+     * @param addr
+     * @param len
+     * @return MemOp
+     */
+    static MemOp read(quint32 addr, quint32 len = 4);
+    /**
+     * @brief
+     *
+     * @param addr
+     * @param data
+     * @return MemOp
+     */
+    static MemOp write(quint32 addr, const QByteArray &data);
+    /**
+     * @brief Single little endian word write.
+     *
+     * @param addr
+     * @param value
+     * @return MemOp
+     */
+    static MemOp writeWord(quint32 addr, quint32 value);
+    /**
+     * @brief Little endian word of the data, 0 past its end.
+     *
+     * @param offset Byte offset in the data
+     * @return quint32
+     */
+    quint32 word(quint32 offset = 0) const;
+};
+const quint16 MAX_READ_V1 = 0x800; /**< Largest 32 bit read for API v1 firmwares */
+const quint16 MAX_READ_V2 = 0x1800; /**< Largest 32 bit read for ST-Link/V2 firmwares, 6KB */
+const quint16 MAX_WRITE = 0x800; /**< Largest 32 bit write of a batch, as the loader buffer writes */
+const quint8 DEFAULT_PIPELINE_DEPTH = 1; /**< Commands in flight unless pipelining passed its test on the probe */
+const quint8 MAX_PIPELINE_DEPTH = 2; /**< Commands in flight, the probe holds one response while running the next command */
+const quint16 PIPELINE_TEST_TIMEOUT = 50; /**< Response deadline of the pipelining test in ms */
+const quint8 HALT_SPIN_POLLS = 8; /**< Status reads without sleeping before waitHalted() backs off */
+const quint32 HALT_BACKOFF_MIN = 50; /**< First waitHalted() sleep in us, doubled on every poll */
+const quint32 HALT_BACKOFF_MAX = 10000; /**< Longest waitHalted() sleep in us */
+const qint64 WAIT_TIMEOUT = -1; /**< waitHalted(), the core still runs at the deadline */
+const qint64 WAIT_ERROR = -2; /**< waitHalted(), the core status could not be read */
+const quint32 HALT_TIMEOUT = 1000; /**< haltMCU() deadline in ms */
 }
 
 namespace STM32 {
@@ -140,6 +210,8 @@ const quint8 F4_CR_SER = 1; /**< TODO: describe */
 const quint8 F4_CR_SNB = 3; /**< TODO: describe */
 const quint8 F4_CR_SNB_MASK = 0x38; /**< TODO: describe */
 const quint8 F4_SR_BSY = 16; /**< TODO: describe */
+const quint8 F4_OPTCR_OFFSET = 0x14; /**< Option control register */
+const quint32 F4_OPTCR_DB1M = (1u << 30); /**< Dual bank mode of the 1MB F42x/F43x parts */
 
 const quint8 ACR_OFFSET = 0x00; /**< TODO: describe */
 const quint8 KEYR_OFFSET = 0x04; /**< TODO: describe */
@@ -184,6 +256,15 @@ const quint32 DCB_DCRSR = 0xE000EDF4; /**< TODO: describe */
 const quint32 DCB_DCRDR = 0xE000EDF8; /**< TODO: describe */
 const quint32 DCB_DEMCR = 0xE000EDFC; /**< TODO: describe */
 }
+namespace CoreReg {
+const quint8 SP = 13; /**< Current stack pointer */
+const quint8 LR = 14; /**< Link register */
+const quint8 PC = 15; /**< Program counter */
+const quint8 XPSR = 16; /**< Program status */
+const quint8 MSP = 17; /**< Main stack pointer */
+const quint8 PSP = 18; /**< Process stack pointer */
+const quint8 COUNT = 21; /**< Words returned by ReadAllRegs, CONTROL/FAULTMASK/BASEPRI/PRIMASK packed in the last ones */
+}
 }
 
 /**
@@ -275,6 +356,18 @@ public slots:
      *
      */
     void setNucleoIDs(void);
+    /**
+     * @brief Selects one probe among the attached ones.
+     *
+     * @param id Probe returned by listProbes()
+     */
+    void setProbe(const QUsbDevice::Id &id);
+    /**
+     * @brief Lists the attached ST-Link V2 and Nucleo probes.
+     *
+     * @return QUsbDevice::IdList
+     */
+    static QUsbDevice::IdList listProbes(void);
 
     /**
      * @brief
@@ -306,6 +399,17 @@ public slots:
      *
      */
     void stepMCU();
+    /**
+     * @brief Waits for the core to stop running.
+     *
+     * The status is polled back to back first, then with sleeps doubling from
+     * STLink::HALT_BACKOFF_MIN to STLink::HALT_BACKOFF_MAX.
+     *
+     * @param timeout Deadline in ms
+     * @return qint64 time to halt in us, STLink::WAIT_TIMEOUT if the core is still running at the deadline,
+     * STLink::WAIT_ERROR if its status could not be read
+     */
+    qint64 waitHalted(quint32 timeout);
     /**
      * @brief
      *
@@ -353,6 +457,21 @@ public slots:
      * @return quint32
      */
     quint32 readRegister(quint8 index);
+    /**
+     * @brief Fetches the whole core register file with a single ReadAllRegs command.
+     *
+     * The core must be halted, the snapshot is kept until it is run, stepped or reset.
+     *
+     * @return bool false if the probe didn't answer
+     */
+    bool readAllRegisters();
+    /**
+     * @brief Returns a register from the snapshot, taking it first if needed.
+     *
+     * @param index Cortex::CoreReg index, below Cortex::CoreReg::COUNT
+     * @return quint32
+     */
+    quint32 getRegister(quint8 index);
     /**
      * @brief
      *
@@ -427,6 +546,12 @@ public slots:
      * @return quint32
      */
     quint32 readFlashSize();
+    /**
+     * @brief Reads the target voltage measured by the probe.
+     *
+     * @return double volts, 0 if the firmware can't measure it
+     */
+    double getTargetVoltage();
     /**
      * @brief
      *
@@ -439,6 +564,12 @@ public slots:
      * @return stlinkv2::STVersion
      */
     stlinkv2::STVersion getVersion();
+    /**
+     * @brief Largest single memory read the probe firmware supports.
+     *
+     * @return quint16
+     */
+    quint16 getMaxReadSize() const;
     /**
      * @brief
      *
@@ -494,6 +625,194 @@ public slots:
      *
      */
     void getLoaderParams();
+    /**
+     * @brief Reads the loader magic and capabilities word.
+     *
+     * @return quint32 0 for loaders predating the extended protocol
+     */
+    quint32 getLoaderVersion();
+    /**
+     * @brief Checks the loader advertises all the given capabilities.
+     *
+     * @param caps Loader::Caps flags
+     * @return bool
+     */
+    bool loaderSupports(quint32 caps);
+    /**
+     * @brief Selects the command the loader runs once it leaves its breakpoint.
+     *
+     * @param cmd Loader::Cmd value
+     * @param len Length parameter, the slot size in stream mode
+     * @return bool
+     */
+    bool setLoaderCommand(quint32 cmd, quint32 len);
+    /**
+     * @brief Fills a stream slot and hands it over to the loader.
+     *
+     * @param slot Slot index
+     * @param slot_size Slot size, including the chunk header
+     * @param addr Flash destination
+     * @param buf Data, an empty buffer ends the stream
+     * @param rle Run-length encode the data when it gets smaller, needs Loader::Caps::RLE
+     * @return bool
+     */
+    bool setLoaderSlot(quint8 slot, quint32 slot_size, quint32 addr, const QByteArray &buf, bool rle = false);
+    /**
+     * @brief Hands over a stream slot that only erases, needs Loader::Caps::SKIP.
+     *
+     * @param slot Slot index
+     * @param slot_size Slot size, including the chunk header
+     * @param addr Flash destination
+     * @param len Length of the erased range
+     * @return bool
+     */
+    bool setLoaderSlotErased(quint8 slot, quint32 slot_size, quint32 addr, quint32 len);
+    /**
+     * @brief Checks whether the loader is done with a stream slot.
+     *
+     * @param slot Slot index
+     * @param status Loader status, read in the same transfer
+     * @param ok Cleared when the status could not be read
+     * @return bool true if the slot can be filled
+     */
+    bool isLoaderSlotFree(quint8 slot, quint32 *status = 0, bool *ok = 0);
+    /**
+     * @brief Posts a job to the running loader's mailbox.
+     *
+     * @param cmd Loader::Cmd value
+     * @return quint32 Job sequence number, 0 on failure
+     */
+    quint32 postLoaderJob(quint32 cmd);
+    /**
+     * @brief Checks whether the loader has completed a mailbox job.
+     *
+     * @param seq Job sequence number
+     * @param status Loader status, read in the same transfer
+     * @param ok Cleared when the status could not be read
+     * @return bool
+     */
+    bool isLoaderJobDone(quint32 seq, quint32 *status = 0, bool *ok = 0);
+    /**
+     * @brief Sets the flash range a loader job works on.
+     *
+     * @param addr Start address
+     * @param len Length in bytes
+     * @return bool
+     */
+    bool setLoaderRange(quint32 addr, quint32 len);
+    /**
+     * @brief Reads the result of the last loader job.
+     *
+     * @return quint32
+     */
+    quint32 getLoaderResult();
+    /**
+     * @brief Bytes of SRAM the loader leaves for its buffer.
+     *
+     * @return quint32
+     */
+    quint32 getLoaderBufferSize();
+    /**
+     * @brief Queues a raw command, nothing is sent until submit().
+     *
+     * @param cmd Command packet
+     * @param resp_len Response length, 0 if none
+     * @param done Called with the response
+     * @param data Data phase, sent right after the command
+     */
+    void queueCommand(const QByteArray &cmd, quint32 resp_len,
+                      std::function<void(const QByteArray &)> done = nullptr,
+                      const QByteArray &data = QByteArray());
+    /**
+     * @brief Queues a 32 bit memory read.
+     *
+     * @param addr
+     * @param len Rounded up to a word
+     * @param done Called with the data
+     */
+    void queueReadMem32(quint32 addr, quint16 len, std::function<void(const QByteArray &)> done);
+    /**
+     * @brief Queues a 32 bit memory write.
+     *
+     * @param addr
+     * @param buf Padded with zeros to a word
+     */
+    void queueWriteMem32(quint32 addr, const QByteArray &buf);
+    /**
+     * @brief Queues a debug register read.
+     *
+     * @param addr
+     * @param done Called with the register value
+     */
+    void queueReadDbgRegister(quint32 addr, std::function<void(quint32)> done);
+    /**
+     * @brief Queues a debug register write.
+     *
+     * @param addr
+     * @param val
+     */
+    void queueWriteDbgRegister(quint32 addr, quint32 val);
+    /**
+     * @brief Sends the queued commands back to back and completes them in order.
+     *
+     * Up to the pipeline depth commands are sent before their responses are read.
+     *
+     * @return bool false if a transfer failed, the rest of the queue is dropped
+     */
+    bool submit();
+    /**
+     * @brief Sets how many commands may wait for their response.
+     *
+     * Deeper pipelines need an API v2 firmware, and two commands sent back to back
+     * must both be answered in time. The probe is left sequential otherwise.
+     *
+     * @param depth 1 for strictly sequential transfers, up to STLink::MAX_PIPELINE_DEPTH
+     * @return bool false if the depth was refused, the pipeline depth is then 1
+     */
+    bool setPipelineDepth(quint8 depth);
+    /**
+     * @brief Runs a batch of memory accesses in one submit().
+     *
+     * Consecutive accesses in the same direction on adjacent ranges are merged in a single transfer,
+     * split again at the probe limits, and the transfers are pipelined. Accesses complete in order.
+     *
+     * @param ops Reads get their data filled in
+     * @return bool false if a transfer failed
+     */
+    bool transfer(QList<STLink::MemOp> *ops);
+    /**
+     * @brief Starts or stops counting the probe commands, the counters are reset when enabled.
+     *
+     * @param enable
+     */
+    void setStatsEnabled(bool enable);
+    /**
+     * @brief Command counters collected since setStatsEnabled().
+     *
+     * @return ProbeStats, empty if disabled
+     */
+    ProbeStats *stats();
+    /**
+     * @brief Writes the address/length pairs of a hash or erase job to the loader buffer.
+     *
+     * @param ranges Flash ranges, lengths may carry job flags
+     * @return bool
+     */
+    bool setLoaderTable(const QList<FlashRange> &ranges);
+    /**
+     * @brief Address/length pairs setLoaderTable() fits in the loader buffer.
+     *
+     * @return int
+     */
+    int getLoaderTableSize();
+    /**
+     * @brief Reads back the results of a hash job.
+     *
+     * @param count Number of ranges
+     * @param crcs One CRC32 per range
+     * @return bool
+     */
+    bool getLoaderHashTable(quint32 count, QList<quint32> *crcs);
 
 private slots:
     /**
@@ -517,6 +836,19 @@ private:
     qint8 mModeId; /**< TODO: describe */
     bool mConnected; /**< TODO: describe */
     LoaderData mLoader; /**< TODO: describe */
+    quint32 mLoaderSeq; /**< Last mailbox job sequence number */
+    QQueue<STLink::Transaction> mQueue; /**< Commands waiting for submit() */
+    quint8 mPipelineDepth; /**< Commands in flight during submit() */
+    quint32 mRegs[Cortex::CoreReg::COUNT]; /**< Register snapshot of the halted core */
+    bool mRegsValid; /**< mRegs matches the core */
+    ProbeStats *const mStats; /**< command counters */
+    bool mStatsEnabled; /**< mStats is updated */
+    QElapsedTimer mStatsClock; /**< time base of the latencies */
+    QByteArray mStatsCmd; /**< last command sent outside submit(), accounted for when the next one starts */
+    qint64 mStatsStart; /**< mStatsCmd sent, ns */
+    qint64 mStatsLast; /**< end of the last mStatsCmd transfer, ns */
+    qint64 mStatsOut; /**< mStatsCmd bytes sent */
+    qint64 mStatsIn; /**< mStatsCmd bytes received */
 
     /**
      * @brief
@@ -565,6 +897,39 @@ private:
      * @return qint32
      */
     qint32 sendCommand(const QByteArray &cmd);
+    /**
+     * @brief Sends a command packet, padded to the firmware command size.
+     *
+     * @param cmd
+     * @return qint32
+     */
+    qint32 writeCommand(const QByteArray &cmd);
+    /**
+     * @brief Sends the data phase of the last command.
+     *
+     * @param data
+     * @return qint32
+     */
+    qint32 writeData(const QByteArray &data);
+    /**
+     * @brief Reads the response of the last command.
+     *
+     * @param len
+     * @return QByteArray
+     */
+    QByteArray readResponse(quint32 len);
+    /**
+     * @brief Accounts for the last command sent by sendCommand().
+     *
+     */
+    void closeStats();
+    /**
+     * @brief Write setting the ownership flag of a filled stream slot, the last access of its batch.
+     *
+     * @param slot
+     * @return STLink::MemOp
+     */
+    STLink::MemOp handOverLoaderSlot(quint8 slot);
     /**
      * @brief
      *
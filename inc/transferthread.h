@@ -22,6 +22,7 @@ This file is part of QSTLink2.
 #include <QString>
 #include <stlinkv2.h>
 #include <compat.h>
+#include "image.h"
 
 /**
  * @brief
@@ -51,6 +52,36 @@ public:
      * @param verify
      */
     void setParams(stlinkv2 *mStlink, QString filename, bool write, bool verify);
+    /**
+     * @brief Only rewrites the erase units that differ from the image.
+     *
+     * @param diff
+     */
+    void setDiff(bool diff);
+    /**
+     * @brief Run-length encodes the streamed chunks, when the loader supports it.
+     *
+     * @param compress
+     */
+    void setCompress(bool compress);
+    /**
+     * @brief Makes the next run a blank check of the whole flash, reset by setParams().
+     *
+     * @param blank
+     */
+    void setBlankCheck(bool blank);
+    /**
+     * @brief Tells that an external VPP is applied, allowing x64 programming on F2/F4.
+     *
+     * @param vpp
+     */
+    void setVpp(bool vpp);
+    /**
+     * @brief Outcome of the last run.
+     *
+     * @return bool true if the transfer and verification succeeded
+     */
+    bool result() const;
 
 signals:
     /**
@@ -104,20 +135,169 @@ private:
      * @brief
      *
      * @param filename
+     * @return bool false on error or abort
+     */
+    bool sendWithLoader(const QString &filename);
+    /**
+     * @brief Uploads the loader and runs it to its breakpoint.
+     *
+     * @param bkp1 Loader breakpoint address
+     * @return bool false on error or abort
+     */
+    bool startLoader(quint32 *bkp1);
+    /**
+     * @brief Steps over the loader breakpoint into its job mailbox.
+     *
+     * @param bkp1 Loader breakpoint address
+     * @return bool
+     */
+    bool enterLoaderMailbox(quint32 bkp1);
+    /**
+     * @brief Waits for a mailbox job to complete.
+     *
+     * @param seq Job sequence number
+     * @param timeout Deadline in ms, see jobTimeout()
+     * @return bool false on loader error, unreadable status, timeout or abort
      */
-    void sendWithLoader(const QString &filename);
+    bool waitLoaderJob(quint32 seq, quint32 timeout);
+    /**
+     * @brief Deadline of a loader job working on bytes of flash.
+     *
+     * Includes the background erase still pending, which the job may wait for.
+     *
+     * @param bytes Flash the job covers
+     * @param per_kb Loader::Timeout::WRITE_KB or READ_KB
+     * @return quint32 ms
+     */
+    quint32 jobTimeout(qint64 bytes, quint32 per_kb) const;
+    /**
+     * @brief Selects the widest program parallelism the target voltage allows.
+     *
+     * x8 from 1.8V, x16 from 2.1V, x32 from 2.7V and x64 with VPP.
+     * Below 1.8V the loader's default is kept, with a warning.
+     *
+     * @return bool false on loader error
+     */
+    bool setupProgramSize();
+    /**
+     * @brief Switches the loader to the device's loader_clock profile.
+     *
+     * The loader keeps its reset clock if the profile can't be applied.
+     *
+     * @return bool false if the loader stopped answering
+     */
+    bool setupClock();
+    /**
+     * @brief Programs the file with one mailbox job per buffer.
+     *
+     * @param image Opened image
+     * @return bool false on error or abort
+     */
+    bool sendMailbox(const ImageSource &image);
+    /**
+     * @brief Hashes the erase units on the target and streams only the ones that differ.
+     *
+     * @param image Opened image
+     * @return bool false on error or abort
+     */
+    bool sendDiff(const ImageSource &image);
+    /**
+     * @brief Streams image ranges through both loader slots, filling one while the other is programmed.
+     *
+     * @param image Opened image
+     * @param ranges Flash ranges to write, covered by the image
+     * @return bool false on error or abort
+     */
+    bool sendStreamed(const ImageSource &image, const QList<FlashRange> &ranges);
+    /**
+     * @brief Erases the units, or whole banks, under the ranges before they are streamed.
+     *
+     * @param ranges Sorted flash ranges to write
+     * @return bool false on error or abort
+     */
+    bool sendErasePlan(const QList<FlashRange> &ranges);
+    /**
+     * @brief Checks that the loader erases the same units as the device's erase units.
+     *
+     * A page loader erasing in steps that divide the page size erases whole pages.
+     * Diff and erase plans rely on it, they would otherwise erase data outside their units.
+     *
+     * @return bool false if the loader did not report its erase step or it doesn't match
+     */
+    bool eraseGeometryMatches();
+    /**
+     * @brief Checks that the loader can erase the device's sectors.
+     *
+     * Loaders with Caps::SECTORS get sector numbers from the erase plan, older ones only know
+     * the F2/F4 layout. Dual bank mode on 1MB F42x/F43x parts (DB1M) is refused.
+     *
+     * @return bool false if the sectors can't be erased safely
+     */
+    bool checkSectorLayout();
+    /**
+     * @brief Splits ranges in chunks of at most size bytes.
+     *
+     * @param ranges
+     * @param size
+     * @return QList<FlashRange>
+     */
+    static QList<FlashRange> splitRanges(const QList<FlashRange> &ranges, quint32 size);
+    /**
+     * @brief Moves the erase plan entries past the first bank to the front, merged and flagged for background erase.
+     *
+     * The loader then erases the other banks while the first one is erased and programmed.
+     * Entries that don't fit in the loader queue stay in the foreground.
+     *
+     * @param plan Erase plan, ERASE_BANK flags set
+     * @param split End of the first bank
+     * @return QList<FlashRange>
+     */
+    static QList<FlashRange> scheduleBackground(const QList<FlashRange> &plan, quint32 split);
+    /**
+     * @brief Checks whether a buffer only holds the erased flash value.
+     *
+     * @param buf
+     * @param erased Erased byte value
+     * @return bool
+     */
+    static bool isErased(const QByteArray &buf, char erased);
     /**
      * @brief
      *
      * @param filename
+     * @return bool false on error or abort
      */
-    void receive(const QString &filename);
+    bool receive(const QString &filename);
     /**
      * @brief
      *
      * @param filename
+     * @return bool false on mismatch, error or abort
+     */
+    bool verify(const QString &filename, quint32 address = 0);
+    /**
+     * @brief Checks that the flash is erased, on target when the loader supports it.
+     *
+     * @return bool true if blank
+     */
+    bool blankCheck();
+    /**
+     * @brief Compares the image with on-target CRCs, reading back only mismatching blocks.
+     *
+     * @param image Opened image
+     * @return bool false on mismatch, error or abort
+     */
+    bool verifyCrc(const ImageSource &image);
+    /**
+     * @brief Reads back part of the flash and compares it with the image.
+     *
+     * @param image Opened image
+     * @param addr Flash address, inside one image range
+     * @param len Number of bytes to compare
+     * @param done Bytes already verified, for progress
+     * @return bool false on mismatch, error or abort
      */
-    void verify(const QString &filename, quint32 address = 0);
+    bool compareRange(const ImageSource &image, quint32 addr, quint32 len, qint64 done);
 
     QString mFilename; /**< TODO: describe */
     bool mWrite; /**< TODO: describe */
@@ -125,6 +305,13 @@ private:
     bool mStop; /**< TODO: describe */
     bool mErase; /**< TODO: describe */
     bool mVerify; /**< TODO: describe */
+    bool mDiff; /**< Differential flashing */
+    bool mCompress; /**< Compressed streaming */
+    bool mBlank; /**< Blank check run */
+    bool mVpp; /**< External VPP applied */
+    bool mResult; /**< Last run outcome */
+    quint32 mEraseStep; /**< Erase step reported by the loader, 0 for whole sectors */
+    quint32 mBackgroundSize; /**< Bytes queued for background erase by the loader */
 };
 
 #endif // TRANSFERTHREAD_H
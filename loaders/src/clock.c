@@ -34,74 +34,106 @@
 #endif
 
 
-/* Run at 24 MHz */
-void stm32_clock_init(void) {
-
-#if !STM32_NO_INIT
-  /* HSI setup, it enforces the reset situation in order to handle possible
-     problems with JTAG probes and re-initializations.*/
-  /* PWR clock enable.*/
-  RCC->APB1ENR = RCC_APB1ENR_PWREN;
-
-  RCC->CR |= RCC_CR_HSION;                  /* Make sure HSI is ON.         */
-  while (!(RCC->CR & RCC_CR_HSIRDY))
-    ;                                       /* Wait until HSI is stable.    */
-
-  /* HSI is selected as new source without touching the other fields in
-     CFGR. Clearing the register has to be postponed after HSI is the
-     new source.*/
-  RCC->CFGR &= ~RCC_CFGR_SW;                /* Reset SW */
-  RCC->CFGR |= RCC_CFGR_SWS_HSI;            /* Select HSI as internal*/
-  while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI)
-    ;                                       /* Wait until HSI is selected.  */
-
-#if defined(STM32F30) || defined(STM32F37) || defined(STM32F1) || defined(STM32F0)
-  /* Clock settings.*/
-  RCC->CFGR  |= RCC_CFGR_PLLSRC_HSI_Div2 | RCC_CFGR_PLLMULL6 ;
+#define CLOCK_TIMEOUT 100000 /* Polls, well over the PLL lock time even from MSI */
 
-#elif defined(STM32F4)
+static uint32_t saved_cr, saved_cfgr, saved_acr;
+#if defined(STM32F2) || defined(STM32F4)
+static uint32_t saved_pllcfgr;
+#endif
+static uint32_t raised = 0;
 
-  /* reset PLL config register */
-  RCC->PLLCFGR = 0;
-  /* set HSI as source for the PLL */
-  RCC->PLLCFGR |= RCC_PLLCFGR_PLLSRC_HSI;
-  /* set division factor for main PLL input clock to 16 */
-  RCC->PLLCFGR |= RCC_PLLCFGR_PLLM_4;
-  /* set main PLL multiplication factor for VCO to 168 */
-   RCC->PLLCFGR |= RCC_PLLCFGR_PLLN_3 | RCC_PLLCFGR_PLLN_5 | RCC_PLLCFGR_PLLN_7;
-  /* set main PLL division factor for main system clock to 4 */
-  RCC->PLLCFGR |= RCC_PLLCFGR_PLLP_0;
+/* Waits for (reg & mask) == value, returns 0 on timeout */
+static uint32_t clock_wait(volatile uint32_t *reg, uint32_t mask, uint32_t value) {
 
-#elif defined(STM32L1)
+  uint32_t i;
+  for (i = 0; i < CLOCK_TIMEOUT; i++) {
+    if ((*reg & mask) == value)
+      return 1;
+  }
+  return 0;
+}
 
-  /* Core voltage setup.*/
-  while ((PWR->CSR & PWR_CSR_VOSF) != 0)
-    ;                           /* Waits until regulator is stable.         */
-  PWR->CR = (1 << 11);
-  while ((PWR->CSR & PWR_CSR_VOSF) != 0)
-    ;                           /* Waits until regulator is stable.         */
+/* Runs from the fastest clock that is safe over the whole voltage range without a crystal:
+   F0 48MHz, F1/F3 64MHz, F2/F4 64MHz and L1 16MHz (HSI, regulator left in range 2).
+   Wait states are raised before switching. Returns 0 if the clock could not be changed. */
+uint32_t clock_fast(void) {
 
-  RCC->CFGR  = 0;
-  RCC->ICSCR = (RCC->ICSCR & ~RCC_ICSCR_MSIRANGE ) |  RCC_ICSCR_MSIRANGE_5;
-  RCC->CR    = RCC_CR_MSION;
-  while ((RCC->CR & RCC_CR_MSIRDY) == 0)
-    ;                           /* Waits until MSI is stable.               */
+  if (raised)
+    return 1;
 
-  RCC->CFGR  = RCC_CFGR_PLLDIV2 | RCC_CFGR_PLLMUL3 | RCC_CFGR_PLLSRC ;
+  saved_cr = RCC->CR;
+  saved_cfgr = RCC->CFGR;
+  saved_acr = FLASH->ACR;
+#if defined(STM32F2) || defined(STM32F4)
+  saved_pllcfgr = RCC->PLLCFGR;
+#endif
+  raised = 1; /* Even half done, clock_restore() puts it back */
 
+  RCC->CR |= RCC_CR_HSION;
+  if (!clock_wait(&RCC->CR, RCC_CR_HSIRDY, RCC_CR_HSIRDY))
+    return 0;
 
-#endif
+#if defined(STM32L1)
+  FLASH->ACR |= FLASH_ACR_ACC64;            /* 64 bit access before the wait state */
+  FLASH->ACR |= FLASH_ACR_PRFTEN | FLASH_ACR_LATENCY;
+  RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSI;
+  return clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_HSI);
+#else
+  /* Run from HSI while the PLL is set up */
+  RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSI;
+  if (!clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_HSI))
+    return 0;
+  RCC->CR &= ~RCC_CR_PLLON;
+  if (!clock_wait(&RCC->CR, RCC_CR_PLLRDY, 0))
+    return 0;
 
-  /* PLL activation.*/
-  RCC->CR   |= RCC_CR_PLLON;
-  while (!(RCC->CR & RCC_CR_PLLRDY))
-    ;                                       /* Waits until PLL is stable.   */
+#if defined(STM32F0)
+  FLASH->ACR = (FLASH->ACR & ~FLASH_ACR_LATENCY) | FLASH_ACR_PRFTBE | 1;
+  /* HSI/2 x12 */
+  RCC->CFGR = (RCC->CFGR & ~(RCC_CFGR_PLLSRC | RCC_CFGR_PLLMULL)) | RCC_CFGR_PLLMULL12;
+#elif defined(STM32F2) || defined(STM32F4)
+  FLASH->ACR = (FLASH->ACR & ~FLASH_ACR_LATENCY) | FLASH_ACR_PRFTEN | FLASH_ACR_ICEN | FLASH_ACR_DCEN | 4;
+  /* HSI/16 x256 /4, APB1 and APB2 within their F2 limits */
+  RCC->PLLCFGR = RCC_PLLCFGR_PLLSRC_HSI | 16 | (256 << 6) | (1 << 16) | (7 << 24);
+  RCC->CFGR = (RCC->CFGR & ~(RCC_CFGR_PPRE1 | RCC_CFGR_PPRE2)) | RCC_CFGR_PPRE1_DIV4 | RCC_CFGR_PPRE2_DIV2;
+#else
+  FLASH->ACR = (FLASH->ACR & ~FLASH_ACR_LATENCY) | FLASH_ACR_PRFTBE | 2;
+  /* HSI/2 x16, APB1 is limited to 36MHz. x16 is reserved on connectivity line parts, they keep the reset clock. */
+  RCC->CFGR = (RCC->CFGR & ~(RCC_CFGR_PLLSRC | RCC_CFGR_PLLMULL | RCC_CFGR_PPRE1)) | RCC_CFGR_PLLMULL16 | RCC_CFGR_PPRE1_DIV2;
+#endif
 
-  /* Switches clock source.*/
-  /* set sysclock to be driven by the PLL clock */
+  RCC->CR |= RCC_CR_PLLON;
+  if (!clock_wait(&RCC->CR, RCC_CR_PLLRDY, RCC_CR_PLLRDY))
+    return 0;
   RCC->CFGR |= RCC_CFGR_SW_PLL;
-  while ((RCC->CFGR & RCC_CFGR_SWS) != (RCC_CFGR_SW_PLL << 2))
-    ;                                       /* Waits selection complete.    */
+  return clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_PLL);
+#endif
+}
+
+/* Goes back to the clock configuration found by clock_fast(), wait states last */
+void clock_restore(void) {
+
+  if (!raised)
+    return;
+  raised = 0;
 
-#endif /* !STM32_NO_INIT */
+  RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSI;
+  clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_HSI);
+  RCC->CR &= ~RCC_CR_PLLON;
+  clock_wait(&RCC->CR, RCC_CR_PLLRDY, 0);
+#if defined(STM32F2) || defined(STM32F4)
+  RCC->PLLCFGR = saved_pllcfgr;
+#endif
+
+  /* Original oscillators and source, HSI is only turned off once unused */
+  RCC->CFGR = (saved_cfgr & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSI;
+  RCC->CR = saved_cr | RCC_CR_HSION;
+  RCC->CFGR = saved_cfgr;
+  clock_wait(&RCC->CFGR, RCC_CFGR_SWS, (saved_cfgr & RCC_CFGR_SW) << 2);
+  RCC->CR = saved_cr;
+
+#if defined(STM32L1)
+  FLASH->ACR = saved_acr | FLASH_ACR_ACC64; /* Wait state off before the 64 bit access */
+#endif
+  FLASH->ACR = saved_acr;
 }
@@ -214,8 +214,6 @@ extern funcp_t __fini_array_end;
  */
 extern int loader(void);
 
-extern void stm32_clock_init(void) ;
-
 /**
  * @brief   Early initialization.
  * @details This hook is invoked immediately after the stack initialization
@@ -254,6 +252,24 @@ void _default_exit(void) {
     ;
 }
 
+/**
+ * @brief   Image header, read by the host.
+ * @details A call to @p main() (BL reaches the whole area on ARMv6-M too),
+ *          the header magic, then the parameters and buffer addresses of
+ *          this build. The host starts the image at its
+ *          first byte.
+ */
+#if !defined(__DOXYGEN__)
+__attribute__((section("vectors"), naked, used))
+#endif
+void _header(void) {
+  asm volatile ("bl      main\n"
+                ".align  2\n"
+                ".word   0x514C4844\n"
+                ".word   __params__\n"
+                ".word   __buffer__\n");
+}
+
 /**
  * @brief   Reset vector.
  */
@@ -334,8 +350,7 @@ int main(void) {
     }
   }
 #endif
-  /* Setup clock */
-  //stm32_clock_init();
+  /* The clock is left as found, the loader raises it on request (clock.c) */
 
   /* Invoking application main() function.*/
   loader();
@@ -42,29 +42,23 @@
 
 #if defined(STM32F2) || defined(STM32F4)
 	#define FLASH_STEP 4
-	#define FLASH_PGM FLASH_ProgramWord
+	#define FLASH_PGM flash_program_psize
 
-	/* Base address of the Flash sectors */
-	#define ADDR_FLASH_SECTOR_0     ((uint32_t)0x08000000) /* Base @ of Sector 0, 16 Kbytes */
-	#define ADDR_FLASH_SECTOR_1     ((uint32_t)0x08004000) /* Base @ of Sector 1, 16 Kbytes */
-	#define ADDR_FLASH_SECTOR_2     ((uint32_t)0x08008000) /* Base @ of Sector 2, 16 Kbytes */
-	#define ADDR_FLASH_SECTOR_3     ((uint32_t)0x0800C000) /* Base @ of Sector 3, 16 Kbytes */
-	#define ADDR_FLASH_SECTOR_4     ((uint32_t)0x08010000) /* Base @ of Sector 4, 64 Kbytes */
-	#define ADDR_FLASH_SECTOR_5     ((uint32_t)0x08020000) /* Base @ of Sector 5, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_6     ((uint32_t)0x08040000) /* Base @ of Sector 6, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_7     ((uint32_t)0x08060000) /* Base @ of Sector 7, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_8     ((uint32_t)0x08080000) /* Base @ of Sector 8, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_9     ((uint32_t)0x080A0000) /* Base @ of Sector 9, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_10    ((uint32_t)0x080C0000) /* Base @ of Sector 10, 128 Kbytes */
-	#define ADDR_FLASH_SECTOR_11    ((uint32_t)0x080E0000) /* Base @ of Sector 11, 128 Kbytes */
-
-	uint32_t GetSector(uint32_t Address);
+	#define SECTOR_COUNT 24 // Two banks of 12 sectors, bank 2 repeats the bank 1 layout
+	#define BANK_SIZE ((uint32_t)0x00100000) // Sectors per bank cover 1MB
+	#define CR_PSIZE ((uint32_t)0x00000300) // FLASH_CR program size
+	#define CR_MER1 ((uint32_t)0x00008000) // FLASH_CR bank 2 mass erase, F42x/F43x
 #elif defined(STM32F0)
 	#define FLASH_STEP 4
 	#define FLASH_PGM FLASH_ProgramWord
 	#define FLASH_PAGE_SIZE         ((uint32_t)0x00000400)   /* FLASH Page Size */
 	uint32_t GetPage(uint32_t Address);
-#elif defined(STM32F1) || defined(STM32F30) || defined(STM32F37)
+#elif defined(STM32F1)
+	#define FLASH_STEP 4
+	#define FLASH_PGM FLASH_ProgramWord
+	#define FLASH_PAGE_SIZE         ((uint32_t)0x00000400)   /* Smallest page, F100 value line. 2KB pages are erased once, the next step finds them blank */
+	uint32_t GetPage(uint32_t Address);
+#elif defined(STM32F30) || defined(STM32F37)
 	#define FLASH_STEP 4
 	#define FLASH_PGM FLASH_ProgramWord
 	#define FLASH_PAGE_SIZE         ((uint32_t)0x00000800)   /* FLASH Page Size */
@@ -72,7 +66,7 @@
 #elif defined(STM32L1)
 	#define FLASH_STEP 4
 	#define FLASH_PGM FLASH_FastProgramWord
-	#define FLASH_PAGE_SIZE         ((uint32_t)0x00000400)   /* FLASH Page Size */
+	#define FLASH_PAGE_SIZE         ((uint32_t)0x00000100)   /* FLASH Page Size */
 	uint32_t GetPage(uint32_t Address);
 #elif defined(STM32F1_LOW_MED)
 	#define FLASH_STEP 4
@@ -83,6 +77,12 @@
 	#error "No valid device specified"
 #endif
 
+#if defined(STM32L1)
+	#define FLASH_ERASED ((uint32_t)0x00000000) // Erased word value
+#else
+	#define FLASH_ERASED ((uint32_t)0xFFFFFFFF) // Erased word value
+#endif
+
 #ifndef FLASH_FLAG_PGERR
 	#define FLASH_FLAG_PGERR 0
 #endif
@@ -96,7 +96,23 @@
 #define mmio16(x)   (*(volatile uint16_t *)(x))
 #define mmio8(x)   (*(volatile uint8_t *)(x))
 
-#define PARAMS_ADDR ((uint32_t)0x200007D0) // Parameters address in the ram.
+#if defined(STM32F1)
+	// XL density parts have a second bank with its own controller, the MD library only drives the first one
+	#define DUAL_CONTROLLER
+	#define BANK2_BASE ((uint32_t)0x08080000)
+	#define FLASH_KEYR2 mmio32(FLASH_R_BASE + 0x44)
+	#define FLASH_SR2 mmio32(FLASH_R_BASE + 0x4C)
+	#define FLASH_CR2 mmio32(FLASH_R_BASE + 0x50)
+	#define FLASH_AR2 mmio32(FLASH_R_BASE + 0x54)
+	#define FLASH_KEY1 ((uint32_t)0x45670123)
+	#define FLASH_KEY2 ((uint32_t)0xCDEF89AB)
+	#define BG_QUEUE 16 // Background erase ranges, the host sends at most this many
+#endif
+
+extern uint32_t __params__;
+extern uint32_t __buffer__;
+
+#define PARAMS_ADDR ((uint32_t)&__params__) // Parameters address in the ram, placed by the linker script after the loader
 
 #define MASK_STRT (1<<0) // Start bit
 #define MASK_BUSY (1<<1) // Busy bit
@@ -109,7 +125,57 @@
 #define MASK_VERR (1<<14) // Verification error
 #define MASK_ERR (1<<15) // Error
 
-#define BUFFER_ADDR 0x20000800
+#define LOADER_MAGIC ((uint32_t)0x514C0000) // Identifies loaders speaking the extended protocol
+#define CAP_STREAM (1<<0) // Double-buffered streaming supported
+#define CAP_MAILBOX (1<<1) // Run-to-completion mailbox supported
+#define CAP_CRC (1<<2) // CRC32 of a flash range supported
+#define CAP_HASH (1<<3) // CRC32 of a list of flash ranges supported
+#define CAP_RLE (1<<4) // Run-length encoded stream chunks supported
+#define CAP_SKIP (1<<5) // Erase only chunks supported, erased words are not programmed
+#define CAP_BLANK (1<<6) // Blank check of a flash range supported, blank units are not erased again
+#define CAP_ERASE (1<<7) // Erase plan supported
+#define CAP_BACKGROUND (1<<8) // Erase plan ranges can be erased in the background while programming another bank
+#define CAP_PSIZE (1<<9) // Program parallelism selected by the debugger
+#define CAP_CLOCK (1<<10) // Clock profile selected by the debugger
+#define CAP_GEOMETRY (1<<11) // Erase step in RESULT at startup, 0 when whole sectors are erased
+#define CAP_SECTORS (1<<12) // Erase plan ranges can name their sector number
+
+#define CMD_PROGRAM 0 // Program DEST/LEN from the buffer, then break (legacy)
+#define CMD_STREAM 1 // Program chunks from the two buffer slots until an empty chunk is received
+#define CMD_MAILBOX 2 // Stay running and execute the jobs posted in the mailbox
+#define CMD_EXIT 3 // Leave the mailbox and go back to the breakpoint
+#define CMD_CRC 4 // CRC32 of DEST/LEN into RESULT (mailbox only)
+#define CMD_HASH 5 // CRC32 of the LEN {address, length} pairs in the buffer (mailbox only)
+#define CMD_BLANK 6 // First non-erased address of DEST/LEN into RESULT, DEST+LEN if blank (mailbox only)
+#define CMD_ERASE 7 // Erase the LEN {address, length} pairs in the buffer, programming stops erasing (mailbox only)
+#define CMD_PSIZE 8 // Program and erase LEN bytes at a time: 1, 2, 4, or 8 with VPP applied (mailbox only)
+#define CMD_CLOCK 9 // Switch to the LEN clock profile, the reset clock is back on exit (mailbox only)
+
+#define CLOCK_RESET 0 // Clock found at startup
+#define CLOCK_FAST 1 // HSI and PLL at the highest frequency safe for the family, see clock.c
+
+#define ERASE_BANK ((uint32_t)1<<31) // Erase plan length flag, the range is a whole bank
+#define ERASE_BACKGROUND ((uint32_t)1<<30) // Erase plan length flag, erase while the jobs that follow run
+#define ERASE_FLAGS (ERASE_BANK | ERASE_BACKGROUND)
+#define ERASE_SECTOR ((uint32_t)1<<29) // Erase plan length flag, the range is the sector numbered in the bits below
+#define ERASE_SNB_SHIFT 24 // Sector number position in the length, bank 2 sectors start at 16
+#define ERASE_SNB_MASK ((uint32_t)0x1F)
+#define ERASE_LEN_MASK ((uint32_t)0x00FFFFFF) // Sector length
+
+#define CHUNK_RLE ((uint32_t)1<<31) // Chunk length flag, the data is run-length encoded
+#define CHUNK_ERASE ((uint32_t)1<<30) // Chunk length flag, erase only, there is no data
+#define CHUNK_FLAGS (CHUNK_RLE | CHUNK_ERASE)
+#define RLE_REPEAT 0x80 // Control bytes from here repeat the next byte (ctl - RLE_REPEAT + RLE_MIN_RUN) times
+#define RLE_MIN_RUN 3 // Shorter repeats are sent as literals
+
+#define CRC_POLY ((uint32_t)0x04C11DB7) // Same polynomial as the CRC unit
+#define CRC_INIT ((uint32_t)0xFFFFFFFF)
+
+#if defined(RCC_AHBENR_CRCEN) || defined(RCC_AHB1ENR_CRCEN)
+	#define HW_CRC
+#endif
+
+#define BUFFER_ADDR ((uint32_t)&__buffer__) // Buffer address, right after the parameters
 #define PARAMS_LEN (BUFFER_ADDR-PARAMS_ADDR)
 
 #define PARAMS ((PARAMS_TypeDef *) PARAMS_ADDR)
@@ -117,163 +183,817 @@
 typedef struct
 {
 	__IO uint32_t DEST;          /*!Address offset: 0x00 - Destination in the flash.  Set by debugger.*/
-	__IO uint32_t LEN;          /*!Address offset: 0x04 - How many bytes we copy data from sram to flash. Set by debugger.*/
+	__IO uint32_t LEN;          /*!Address offset: 0x04 - How many bytes we copy data from sram to flash. Slot size in stream mode. Set by debugger.*/
 	__IO uint32_t STATUS;          /*!Address offset: 0x08 -  Status. Set by program and debugger. */
 	__IO uint32_t POS;          /*!Address offset: 0x0C -  Current position */
 	__IO uint32_t TEST;          /*!Address offset: 0x10 -  For testing */
+	__IO uint32_t VERSION;          /*!Address offset: 0x14 -  Magic and capabilities. Set by program. */
+	__IO uint32_t CMD;          /*!Address offset: 0x18 -  Command to run after the breakpoint. Set by debugger. */
+	__IO uint32_t OWNER[2];          /*!Address offset: 0x1C -  Slot ownership, non-zero when the slot is filled. Set by debugger, cleared by program. */
+	__IO uint32_t SEQ;          /*!Address offset: 0x24 -  Mailbox, a new value posts the job in CMD. Set by debugger. */
+	__IO uint32_t ACK;          /*!Address offset: 0x28 -  Sequence number of the last completed job. Set by program. */
+	__IO uint32_t RESULT;          /*!Address offset: 0x2C -  Job result, CRC32 for CMD_CRC. Set by program. */
 
 } PARAMS_TypeDef;
 
-extern uint32_t __params__;
-extern uint32_t __buffer__;
+typedef struct
+{
+	__IO uint32_t DEST;          /*!Address offset: 0x00 - Destination in the flash.*/
+	__IO uint32_t LEN;          /*!Address offset: 0x04 - Length to program, 0 ends the stream. CHUNK_ flags in the upper bits.*/
+	uint32_t DATA[];          /*!Address offset: 0x08 - Data to program.*/
 
-int loader(void) {
+} CHUNK_TypeDef;
 
-	uint32_t i, from, to;
-	uint32_t erased_sectors = 0;
-	for (i=0;i < PARAMS_LEN ;i+=4) { // Clear parameters
-		mmio32(PARAMS_ADDR+i) = 0;
+uint32_t clock_fast(void);
+void clock_restore(void);
+
+static uint32_t erased_sectors = 0;
+static uint32_t erase_planned = 0; // Set once the host erased everything it will program
+
+#if defined(STM32F2) || defined(STM32F4)
+static uint32_t psize = 4; // Program parallelism in bytes, x32 works from 2.7V
+static uint8_t voltage_range = VoltageRange_3; // Erase parallelism matching psize
+static uint32_t pending = 0; // Low word waiting for its pair in x64 mode
+static uint32_t pending_dest = 0; // Its address, 0 when there is none
+#endif
+
+/* Returns the first address in the range not holding the erased value, addr+len if it is blank */
+static uint32_t blank_check(uint32_t addr, uint32_t len) {
+
+	uint32_t end = addr + len;
+	while (addr + 4 <= end && mmio32(addr) == FLASH_ERASED) // Word-wide compares
+		addr += 4;
+	if (addr + 4 <= end) // Found a word, narrow it down
+		end = addr + 4;
+	while (addr < end && mmio8(addr) == (uint8_t)FLASH_ERASED)
+		addr++;
+	return addr;
+}
+
+#if defined(DUAL_CONTROLLER)
+static uint32_t bank2_unlocked = 0;
+static uint32_t bg_addr[BG_QUEUE]; // Next address to erase, or bank base
+static uint32_t bg_len[BG_QUEUE]; // Remaining length, ERASE_BANK for a mass erase
+static uint32_t bg_head = 0, bg_count = 0;
+
+static void bank2_unlock(void) {
+
+	if (!bank2_unlocked) {
+		FLASH_KEYR2 = FLASH_KEY1;
+		FLASH_KEYR2 = FLASH_KEY2;
+		bank2_unlocked = 1;
+	}
+}
+
+/* Returns 1 once the last bank 2 operation is over, its errors go in the status */
+static uint32_t bank2_idle(void) {
+
+	const uint32_t sr = FLASH_SR2;
+	if (sr & FLASH_SR_BSY)
+		return 0;
+	if (sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR))
+		PARAMS->STATUS |= MASK_ERR;
+	FLASH_SR2 = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR; // Write 1 to clear
+	FLASH_CR2 &= ~(FLASH_CR_PG | FLASH_CR_PER | FLASH_CR_MER);
+	return 1;
+}
+
+/* Starts the next background erase once bank 2 is idle, never waits. Returns 1 when everything is erased. */
+static uint32_t bank2_erase_step(void) {
+
+	if (!bg_count)
+		return 1;
+	if (!bank2_idle())
+		return 0;
+
+	while (bg_count) {
+		const uint32_t addr = bg_addr[bg_head];
+		const uint32_t len = bg_len[bg_head];
+		if (len == 0) { // Range done
+			bg_head = (bg_head + 1) % BG_QUEUE;
+			bg_count--;
+			continue;
+		}
+		if (len & ERASE_BANK) {
+			bg_len[bg_head] = 0;
+			FLASH_CR2 |= FLASH_CR_MER;
+		}
+		else {
+			// Ranges come from the erase plan, page aligned
+			bg_addr[bg_head] = addr + FLASH_PAGE_SIZE;
+			bg_len[bg_head] = len > FLASH_PAGE_SIZE ? len - FLASH_PAGE_SIZE : 0;
+			if (blank_check(addr, FLASH_PAGE_SIZE) == addr + FLASH_PAGE_SIZE) // Already blank
+				continue;
+			FLASH_CR2 |= FLASH_CR_PER;
+			FLASH_AR2 = addr;
+		}
+		FLASH_CR2 |= FLASH_CR_STRT;
+		PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+		return 0;
 	}
+	return 1;
+}
 
-    FLASH_SetLatency(FLASH_Latency_0);
+/* Queues a range to erase in the background, returns 0 if the queue is full */
+static uint32_t bank2_erase_queue(uint32_t addr, uint32_t len) {
+
+	if (bg_count == BG_QUEUE || addr < BANK2_BASE)
+		return 0;
+	bank2_unlock();
+	bg_addr[(bg_head + bg_count) % BG_QUEUE] = addr;
+	bg_len[(bg_head + bg_count) % BG_QUEUE] = len;
+	bg_count++;
+	bank2_erase_step();
+	return 1;
+}
 
-	while (1) {
+/* Waits for the background erase and the last bank 2 operation */
+static void bank2_wait(void) {
 
-		asm volatile ("bkpt"); // Halt core after init and before writing to flash.
-		asm volatile ("nop");
+	while (!bank2_erase_step());
+	while (!bank2_idle());
+}
 
-		PARAMS->STATUS &= ~MASK_STRT; // Clear start bit
-		PARAMS->STATUS  &= ~MASK_ERR; // Clear error bit
-		PARAMS->STATUS  &= ~MASK_SUCCESS; // Clear success bit
-		PARAMS->STATUS &= ~MASK_DEL; // Clear delete success bit
-        PARAMS->POS = PARAMS->DEST;
+/* Bank 2 page erase, waits for it */
+static FLASH_Status bank2_erase_page(uint32_t addr) {
 
-		FLASH_Unlock();
+	bank2_unlock();
+	bank2_wait();
+	FLASH_CR2 |= FLASH_CR_PER;
+	FLASH_AR2 = addr;
+	FLASH_CR2 |= FLASH_CR_STRT;
+	bank2_wait();
+	return (PARAMS->STATUS & MASK_ERR) ? FLASH_ERROR_PG : FLASH_COMPLETE;
+}
 
-		from = PARAMS->DEST;
-		to = from + PARAMS->LEN;
-		uint32_t a;
+/* Bank 2 mass erase, waits for it */
+static FLASH_Status bank2_erase_all(void) {
 
-		// Erase flash where needed
-		#if defined(STM32F2) || defined(STM32F4)
-			FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR|FLASH_FLAG_PGSERR);
-			// Get the number of the start and end sectors
-			const uint32_t StartSector = GetSector(from);
-            const uint32_t EndSector = GetSector(to-1);
-			for (a = StartSector ; a <= EndSector ; a+=8) {
-				if (erased_sectors & (1 << a/8)) continue; // Skip sectors already erased
-				if (FLASH_EraseSector(a, VoltageRange_3) != FLASH_COMPLETE) {
-					PARAMS->STATUS |= MASK_ERR;
-					break;
-				}
-				erased_sectors |= 1 << a/8;
-				PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+	bank2_unlock();
+	bank2_wait();
+	FLASH_CR2 |= FLASH_CR_MER;
+	FLASH_CR2 |= FLASH_CR_STRT;
+	bank2_wait();
+	return (PARAMS->STATUS & MASK_ERR) ? FLASH_ERROR_PG : FLASH_COMPLETE;
+}
+
+/* Program one word as two half words, in either bank */
+static FLASH_Status flash_program_word(uint32_t addr, uint32_t data) {
+
+	if (addr < BANK2_BASE)
+		return FLASH_ProgramWord(addr, data);
+
+	bank2_unlock();
+	bank2_wait();
+	FLASH_CR2 |= FLASH_CR_PG;
+	mmio16(addr) = (uint16_t)data;
+	bank2_wait();
+	FLASH_CR2 |= FLASH_CR_PG;
+	mmio16(addr + 2) = (uint16_t)(data >> 16);
+	bank2_wait();
+	return (PARAMS->STATUS & MASK_ERR) ? FLASH_ERROR_PG : FLASH_COMPLETE;
+}
+
+static FLASH_Status flash_erase_page(uint32_t addr) {
+
+	if (addr < BANK2_BASE)
+		return FLASH_ErasePage(addr);
+	return bank2_erase_page(addr);
+}
+
+static void flash_unlock(void) {
+
+	FLASH_Unlock(); // Bank 2 is unlocked when first used, it does not exist on smaller parts
+}
+
+static void flash_lock(void) {
+
+	FLASH_Lock();
+	if (bank2_unlocked && !bg_count && bank2_idle()) { // Keep it open for the background erase
+		FLASH_CR2 |= FLASH_CR_LOCK;
+		bank2_unlocked = 0;
+	}
+}
+#else
+	#define flash_program_word FLASH_PGM
+	#define flash_erase_page FLASH_ErasePage
+	#define flash_unlock FLASH_Unlock
+	#define flash_lock FLASH_Lock
+
+static uint32_t bank2_erase_step(void) {
+
+	return 1;
+}
+#endif
+
+#if defined(STM32F2) || defined(STM32F4)
+/* Base address of sector n: 4x16KB, 64KB then 128KB sectors in each bank */
+static uint32_t sector_base(uint32_t n) {
+
+	uint32_t base = FLASH_BASE;
+	if (n >= SECTOR_COUNT/2) {
+		base += BANK_SIZE;
+		n -= SECTOR_COUNT/2;
+	}
+	if (n < 4)
+		return base + (n * 0x4000);
+	if (n == 4)
+		return base + 0x10000;
+	return base + 0x20000 + ((n - 5) * 0x20000);
+}
+
+/* Sector holding an address */
+static uint32_t sector_index(uint32_t addr) {
+
+	uint32_t n = 0;
+	while (n < SECTOR_COUNT-1 && addr >= sector_base(n+1))
+		n++;
+	return n;
+}
+
+/* FLASH_Sector_x value of sector n, bank 2 sector numbers start at 16 */
+static uint32_t sector_snb(uint32_t n) {
+
+	if (n >= SECTOR_COUNT/2)
+		n += 4;
+	return n << 3;
+}
+
+/* Erases an erase plan sector. The host numbers it from the part's own layout, the map above only fits F2/F4 single bank mode. */
+static void plan_sector_erase(uint32_t addr, uint32_t len) {
+
+	const uint32_t size = len & ERASE_LEN_MASK;
+	if (blank_check(addr, size) == addr + size) // Already blank, much faster than erasing
+		return;
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR|FLASH_FLAG_PGSERR);
+	if (FLASH_EraseSector(((len >> ERASE_SNB_SHIFT) & ERASE_SNB_MASK) << 3, voltage_range) != FLASH_COMPLETE)
+		PARAMS->STATUS |= MASK_ERR;
+	else
+		PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+}
+#endif
+
+/* Erase flash where needed */
+static void flash_erase(uint32_t from, uint32_t to) {
+
+	uint32_t a;
+
+	#if defined(DUAL_CONTROLLER)
+		if (to > BANK2_BASE && bg_count) // Let the background erase get there first
+			bank2_wait();
+	#endif
+
+	if (erase_planned) // Done by the erase plan
+		return;
+
+	#if defined(STM32F2) || defined(STM32F4)
+		FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR|FLASH_FLAG_PGSERR);
+		// Get the number of the start and end sectors
+		const uint32_t StartSector = sector_index(from);
+		const uint32_t EndSector = sector_index(to-1);
+		for (a = StartSector ; a <= EndSector ; a++) {
+			if (erased_sectors & (1 << a)) continue; // Skip sectors already erased
+			const uint32_t base = sector_base(a);
+			const uint32_t next = sector_base(a + 1);
+			if (blank_check(base, next - base) == next) { // Already blank, much faster than erasing
+				erased_sectors |= 1 << a;
+				continue;
 			}
-		#else
-			FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
-            uint32_t NbrOfPage = (to - from - 1) / FLASH_PAGE_SIZE;
-			for (a = 0 ; a <= NbrOfPage ; a++) {
-				if (erased_sectors >= from + (FLASH_PAGE_SIZE * a)) continue; // Skip sectors already erased
-				if (FLASH_ErasePage(from + (FLASH_PAGE_SIZE * a))!= FLASH_COMPLETE) {
-					PARAMS->STATUS |= MASK_ERR;
-					break;
-				}
-				erased_sectors = from + (FLASH_PAGE_SIZE * a);
-				PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+			if (FLASH_EraseSector(sector_snb(a), voltage_range) != FLASH_COMPLETE) {
+				PARAMS->STATUS |= MASK_ERR;
+				break;
 			}
-		#endif
+			erased_sectors |= 1 << a;
+			PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+		}
+	#else
+		FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
+		// Start from the page holding from, chunks are not always page aligned
+		for (a = from & ~(FLASH_PAGE_SIZE - 1) ; a < to ; a += FLASH_PAGE_SIZE) {
+			if (erased_sectors >= a) continue; // Skip sectors already erased
+			if (blank_check(a, FLASH_PAGE_SIZE) == a + FLASH_PAGE_SIZE) { // Already blank, much faster than erasing
+				erased_sectors = a;
+				continue;
+			}
+			if (flash_erase_page(a)!= FLASH_COMPLETE) {
+				PARAMS->STATUS |= MASK_ERR;
+				break;
+			}
+			erased_sectors = a;
+			PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+		}
+	#endif
+}
 
-		if (PARAMS->STATUS & MASK_ERR) { // If error during page delete, go back to breakpoint
-			FLASH_Lock();
-			continue;
+/* Mass erase of the bank holding addr, falls back to erasing len bytes where unavailable */
+static void bank_erase(uint32_t addr, uint32_t len) {
+
+	FLASH_Status status;
+
+	#if defined(STM32F2) || defined(STM32F4)
+		FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR|FLASH_FLAG_PGSERR);
+		if (addr < FLASH_BASE + BANK_SIZE) {
+			status = FLASH_EraseAllSectors(voltage_range);
+		}
+		else { // No library call for the second bank
+			status = FLASH_WaitForLastOperation();
+			if (status == FLASH_COMPLETE) {
+				FLASH->CR = (FLASH->CR & ~CR_PSIZE) | ((uint32_t)voltage_range << 8); // PSIZE matches the voltage range
+				FLASH->CR |= CR_MER1;
+				FLASH->CR |= FLASH_CR_STRT;
+				status = FLASH_WaitForLastOperation();
+				FLASH->CR &= ~CR_MER1;
+			}
+		}
+	#elif defined(STM32L1)
+		flash_erase(addr, addr + len); // No mass erase on L1
+		return;
+	#else
+		FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_PGERR | FLASH_FLAG_WRPERR);
+		if (addr == FLASH_BASE) {
+			status = FLASH_EraseAllPages(); // First bank only
+		}
+		#if defined(DUAL_CONTROLLER)
+		else if (addr == BANK2_BASE) {
+			status = bank2_erase_all();
 		}
+		#endif
+		else {
+			flash_erase(addr, addr + len);
+			return;
+		}
+	#endif
+
+	if (status != FLASH_COMPLETE)
+		PARAMS->STATUS |= MASK_ERR;
+	else
+		PARAMS->STATUS |= MASK_DEL; // Set delete success bit
+}
 
-		// Flash programming
-		uint32_t i=0;
-		while (i < PARAMS->LEN) {
+/* Erase each {address, length} pair of the table in the buffer, then stop erasing before programming.
+   Background pairs are queued and erased while the next pairs and jobs run, where the bank has its own controller. */
+static void erase_table(uint32_t count) {
 
-			if (FLASH_PGM(PARAMS->DEST+i,  mmio32(BUFFER_ADDR+i)) == FLASH_COMPLETE)
-			{
-				i+=FLASH_STEP;
+	uint32_t i;
+
+	erase_planned = 0; // The plan may take several jobs
+
+	flash_unlock();
+
+	for (i=0; i < count && !(PARAMS->STATUS & MASK_ERR); i++) {
+		const uint32_t addr = mmio32(BUFFER_ADDR + (i * 8));
+		const uint32_t len = mmio32(BUFFER_ADDR + (i * 8) + 4);
+		PARAMS->POS = addr;
+		#if defined(DUAL_CONTROLLER)
+			if ((len & ERASE_BACKGROUND) && bank2_erase_queue(addr, len & ~ERASE_BACKGROUND))
+				continue;
+		#endif
+		#if defined(STM32F2) || defined(STM32F4)
+			if (len & ERASE_SECTOR) {
+				plan_sector_erase(addr, len);
+				continue;
+			}
+		#endif
+		if (len & ERASE_BANK)
+			bank_erase(addr, len & ~ERASE_FLAGS);
+		else
+			flash_erase(addr, addr + (len & ~ERASE_FLAGS));
+	}
+
+	flash_lock();
+
+	if (!(PARAMS->STATUS & MASK_ERR))
+		PARAMS->STATUS |= MASK_SUCCESS;
+	erase_planned = 1;
+}
+
+#if defined(STM32F2) || defined(STM32F4)
+/* Selects the parallelism, the erase voltage range goes with it */
+static void set_psize(uint32_t size) {
+
+	switch (size) {
+		case 1:
+			voltage_range = VoltageRange_1;
+			break;
+		case 2:
+			voltage_range = VoltageRange_2;
+			break;
+		case 8:
+			voltage_range = VoltageRange_4;
+			break;
+		default:
+			size = 4;
+			voltage_range = VoltageRange_3;
+			break;
+	}
+	psize = size;
+	pending_dest = 0;
+	PARAMS->RESULT = size;
+}
+
+/* Program one word with the selected parallelism.
+   In x64 mode the low word of a pair waits for the high one, flash_flush() programs a lone one. */
+static FLASH_Status flash_program_psize(uint32_t dest, uint32_t word) {
+
+	FLASH_Status status = FLASH_COMPLETE;
+	uint32_t i;
+
+	switch (psize) {
+		case 1:
+			for (i=0; i < 4 && status == FLASH_COMPLETE; i++)
+				status = FLASH_ProgramByte(dest+i, (uint8_t)(word >> (i*8)));
+			return status;
+		case 2:
+			status = FLASH_ProgramHalfWord(dest, (uint16_t)word);
+			if (status == FLASH_COMPLETE)
+				status = FLASH_ProgramHalfWord(dest+2, (uint16_t)(word >> 16));
+			return status;
+		case 8:
+			if (pending_dest && pending_dest + 4 == dest) {
+				pending_dest = 0;
+				return FLASH_ProgramDoubleWord(dest-4, ((uint64_t)word << 32) | pending);
+			}
+			return FLASH_ProgramWord(dest, word);
+		default:
+			return FLASH_ProgramWord(dest, word);
+	}
+}
+
+/* Program the low word still waiting for its pair, returns 0 on error */
+static uint32_t flash_flush(void) {
+
+	const uint32_t dest = pending_dest;
+	pending_dest = 0;
+	if (dest && pending != FLASH_ERASED && FLASH_ProgramWord(dest, pending) != FLASH_COMPLETE) {
+		PARAMS->STATUS |= MASK_ERR; // Set error bit
+		return 0;
+	}
+	return 1;
+}
+#else
+static uint32_t flash_flush(void) {
+
+	return 1;
+}
+#endif
+
+/* Program one word, returns 0 on error. The destination is erased, erased values are skipped. */
+static uint32_t flash_word(uint32_t dest, uint32_t word) {
+
+	uint32_t erased = (word == FLASH_ERASED);
+
+	#if defined(STM32F2) || defined(STM32F4)
+		if (psize == 8) {
+			if (!(dest & 4)) { // Low word, programmed with the next one
+				if (!flash_flush())
+					return 0;
+				pending = word;
+				pending_dest = dest;
 				PARAMS->STATUS |= MASK_SUCCESS; // Set success bit
-				PARAMS->POS = PARAMS->DEST+i;
+				PARAMS->POS = dest+FLASH_STEP;
+				return 1;
+			}
+			if (pending_dest + 4 == dest) { // Skip the pair only if both halves are erased
+				erased = erased && pending == FLASH_ERASED;
+				if (erased)
+					pending_dest = 0;
+			}
+		}
+	#endif
+
+	bank2_erase_step(); // Keep the other bank busy
+
+	if (!erased && flash_program_word(dest, word) != FLASH_COMPLETE) {
+		/* Error occurred while writing data in Flash memory.
+		User can add here some code to deal with this error */
+		PARAMS->STATUS |= MASK_ERR; // Set error bit
+		return 0;
+	}
+	PARAMS->STATUS |= MASK_SUCCESS; // Set success bit
+	PARAMS->POS = dest+FLASH_STEP;
+	return 1;
+}
+
+/* Erase then program len bytes from src to dest */
+static void flash_write(uint32_t dest, uint32_t src, uint32_t len) {
+
+	PARAMS->POS = dest;
+
+	flash_unlock();
+
+	flash_erase(dest, dest + len);
+
+	if (PARAMS->STATUS & MASK_ERR) { // If error during page delete, stop here
+		flash_lock();
+		return;
+	}
+
+	// Flash programming
+	uint32_t i=0;
+	while (i < len) {
+
+		if (!flash_word(dest+i, mmio32(src+i)))
+			break;
+		i+=FLASH_STEP;
+	}
+	flash_flush();
+	PARAMS->TEST =  dest+i;
+
+	flash_lock(); // Lock flash after operations are done.
+}
+
+/* Erase then program len bytes decoded from src to dest.
+   Each packet starts with a control byte, below RLE_REPEAT it is followed by ctl+1 literal bytes,
+   otherwise by one byte repeated. Words are programmed as soon as they are complete. */
+static void flash_write_rle(uint32_t dest, uint32_t src, uint32_t len) {
+
+	PARAMS->POS = dest;
+
+	flash_unlock();
+
+	flash_erase(dest, dest + len);
+
+	if (PARAMS->STATUS & MASK_ERR) { // If error during page delete, stop here
+		flash_lock();
+		return;
+	}
+
+	uint32_t i=0, run=0, word=0, literal=0;
+	uint8_t value=0;
+	while (i < len) {
+
+		if (run == 0) { // Next packet
+			const uint8_t ctl = mmio8(src++);
+			literal = ctl < RLE_REPEAT;
+			if (literal) {
+				run = ctl + 1;
 			}
 			else {
-				/* Error occurred while writing data in Flash memory.
-				User can add here some code to deal with this error */
-				PARAMS->STATUS |= MASK_ERR; // Set error bit
-				break;
+				run = ctl - RLE_REPEAT + RLE_MIN_RUN;
+				value = mmio8(src++);
 			}
 		}
-		PARAMS->TEST =  PARAMS->DEST+i;
 
-		FLASH_Lock(); // Lock flash after operations are done.
+		word |= (uint32_t)(literal ? mmio8(src++) : value) << ((i & 3) * 8);
+		run--;
+		i++;
+
+		if ((i & 3) == 0) { // Word complete
+			if (!flash_word(dest+i-4, word))
+				break;
+			word = 0;
+		}
 	}
-	return 0;
+	flash_flush();
+	PARAMS->TEST =  dest+i;
+
+	flash_lock(); // Lock flash after operations are done.
 }
 
-#if defined(STM32F2) || defined(STM32F4)
-/**
-  * @brief  Gets the sector of a given address
-  * @param  None
-  * @retval The sector of a given address
-  */
-uint32_t GetSector(uint32_t Address)
-{
-  uint32_t sector = 0;
-
-  if((Address < ADDR_FLASH_SECTOR_1) && (Address >= ADDR_FLASH_SECTOR_0))
-  {
-    sector = FLASH_Sector_0;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_2) && (Address >= ADDR_FLASH_SECTOR_1))
-  {
-    sector = FLASH_Sector_1;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_3) && (Address >= ADDR_FLASH_SECTOR_2))
-  {
-    sector = FLASH_Sector_2;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_4) && (Address >= ADDR_FLASH_SECTOR_3))
-  {
-    sector = FLASH_Sector_3;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_5) && (Address >= ADDR_FLASH_SECTOR_4))
-  {
-    sector = FLASH_Sector_4;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_6) && (Address >= ADDR_FLASH_SECTOR_5))
-  {
-    sector = FLASH_Sector_5;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_7) && (Address >= ADDR_FLASH_SECTOR_6))
-  {
-    sector = FLASH_Sector_6;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_8) && (Address >= ADDR_FLASH_SECTOR_7))
-  {
-    sector = FLASH_Sector_7;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_9) && (Address >= ADDR_FLASH_SECTOR_8))
-  {
-    sector = FLASH_Sector_8;
-  }
-  else if((Address < ADDR_FLASH_SECTOR_10) && (Address >= ADDR_FLASH_SECTOR_9))
-  {
-    sector = FLASH_Sector_9;  
-  }
-  else if((Address < ADDR_FLASH_SECTOR_11) && (Address >= ADDR_FLASH_SECTOR_10))
-  {
-    sector = FLASH_Sector_10;  
-  }
-  else/*(Address < FLASH_END_ADDR) && (Address >= ADDR_FLASH_SECTOR_11))*/
-  {
-    sector = FLASH_Sector_11;  
-  }
-
-  return sector;
+/* Erase the pages or sectors under a chunk made only of erased values */
+static void flash_write_erased(uint32_t dest, uint32_t len) {
+
+	PARAMS->POS = dest;
+
+	flash_unlock();
+
+	flash_erase(dest, dest + len);
+
+	if (!(PARAMS->STATUS & MASK_ERR)) {
+		PARAMS->STATUS |= MASK_SUCCESS; // Set success bit
+		PARAMS->POS = dest+len;
+	}
+	PARAMS->TEST =  PARAMS->POS;
+
+	flash_lock(); // Lock flash after operations are done.
+}
+
+/* Program a chunk, len carries the CHUNK_ flags */
+static void flash_chunk(uint32_t dest, uint32_t src, uint32_t len) {
+
+	if (len & CHUNK_ERASE)
+		flash_write_erased(dest, len & ~CHUNK_FLAGS);
+	else if (len & CHUNK_RLE)
+		flash_write_rle(dest, src, len & ~CHUNK_FLAGS);
+	else
+		flash_write(dest, src, len);
+}
+
+/* Program chunks from both slots alternately, the debugger fills one slot while we program the other */
+static void stream(void) {
+
+	const uint32_t slot_size = PARAMS->LEN;
+	uint32_t slot = 0;
+
+	while (1) {
+
+		while (!PARAMS->OWNER[slot]) // Wait for the debugger to hand over the slot
+			bank2_erase_step();
+
+		CHUNK_TypeDef *chunk = (CHUNK_TypeDef *) (BUFFER_ADDR + (slot * slot_size));
+		if (chunk->LEN == 0) { // End of stream
+			#if defined(DUAL_CONTROLLER)
+				bank2_wait(); // Background erase errors belong to this job
+				flash_lock();
+			#endif
+			PARAMS->OWNER[slot] = 0;
+			return;
+		}
+
+		flash_chunk(chunk->DEST, (uint32_t) chunk->DATA, chunk->LEN);
+		if (PARAMS->STATUS & MASK_ERR) // Keep the slot, the debugger will see the error
+			return;
+
+		PARAMS->OWNER[slot] = 0; // Give the slot back
+		slot ^= 1;
+	}
 }
 
+#if defined(HW_CRC)
+static void crc_init(void) {
+
+	#if defined(RCC_AHB1ENR_CRCEN)
+		RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
+	#else
+		RCC->AHBENR |= RCC_AHBENR_CRCEN;
+	#endif
+}
 #else
+/* Nibble table for the MSB first polynomial, small enough for the loader area */
+static const uint32_t crc_table[16] = {
+	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+	0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+};
 
+static void crc_init(void) {
+}
 #endif
+
+/* CRC32 of len bytes at addr, fed as little endian words like the CRC unit does.
+   A trailing partial word is padded with 0xFF. */
+static uint32_t crc_range(uint32_t addr, uint32_t len) {
+
+	uint32_t i, word;
+
+	#if defined(HW_CRC)
+		CRC->CR = CRC_CR_RESET;
+	#else
+		uint32_t crc = CRC_INIT;
+	#endif
+
+	for (i=0; i < len; i+=4) {
+		if (len - i >= 4) {
+			word = mmio32(addr+i);
+		}
+		else {
+			uint32_t b;
+			word = 0xFFFFFFFF;
+			for (b=0; b < len - i; b++) {
+				word &= ~(0xFF << (b*8));
+				word |= mmio8(addr+i+b) << (b*8);
+			}
+		}
+		#if defined(HW_CRC)
+			CRC->DR = word;
+		#else
+			uint32_t n;
+			crc ^= word;
+			for (n=0; n < 8; n++)
+				crc = (crc << 4) ^ crc_table[crc >> 28];
+		#endif
+	}
+
+	#if defined(HW_CRC)
+		return CRC->DR;
+	#else
+		return crc;
+	#endif
+}
+
+/* CRC32 of each {address, length} pair of the table in the buffer.
+   Results overwrite the table, pair i is read before result i is stored. */
+static void hash_table(uint32_t count) {
+
+	uint32_t i;
+	for (i=0; i < count; i++) {
+		const uint32_t addr = mmio32(BUFFER_ADDR + (i * 8));
+		const uint32_t len = mmio32(BUFFER_ADDR + (i * 8) + 4);
+		mmio32(BUFFER_ADDR + (i * 4)) = crc_range(addr, len);
+	}
+}
+
+static void clear_status(void) {
+
+	PARAMS->STATUS &= ~MASK_STRT; // Clear start bit
+	PARAMS->STATUS  &= ~MASK_ERR; // Clear error bit
+	PARAMS->STATUS  &= ~MASK_SUCCESS; // Clear success bit
+	PARAMS->STATUS &= ~MASK_DEL; // Clear delete success bit
+}
+
+/* Run jobs as they are posted, without halting the core in between */
+static void mailbox(void) {
+
+	while (1) {
+
+		while (PARAMS->SEQ == PARAMS->ACK) // Wait for the debugger to post a job
+			bank2_erase_step();
+
+		clear_status();
+
+		switch (PARAMS->CMD) {
+			case CMD_PROGRAM:
+				flash_chunk(PARAMS->DEST, BUFFER_ADDR, PARAMS->LEN);
+				break;
+			case CMD_STREAM:
+				stream();
+				break;
+			case CMD_CRC:
+				PARAMS->RESULT = crc_range(PARAMS->DEST, PARAMS->LEN);
+				PARAMS->STATUS |= MASK_SUCCESS;
+				break;
+			case CMD_HASH:
+				hash_table(PARAMS->LEN);
+				PARAMS->STATUS |= MASK_SUCCESS;
+				break;
+			case CMD_BLANK:
+				PARAMS->RESULT = blank_check(PARAMS->DEST, PARAMS->LEN);
+				PARAMS->STATUS |= MASK_SUCCESS;
+				break;
+			case CMD_ERASE:
+				erase_table(PARAMS->LEN);
+				break;
+			case CMD_PSIZE:
+				#if defined(STM32F2) || defined(STM32F4)
+					set_psize(PARAMS->LEN);
+					PARAMS->STATUS |= MASK_SUCCESS;
+				#else
+					PARAMS->STATUS |= MASK_ERR; // Fixed parallelism
+				#endif
+				break;
+			case CMD_CLOCK:
+				clock_restore();
+				if (PARAMS->LEN == CLOCK_FAST && !clock_fast()) {
+					clock_restore();
+					PARAMS->STATUS |= MASK_ERR;
+				}
+				else {
+					PARAMS->STATUS |= MASK_SUCCESS;
+				}
+				break;
+			case CMD_EXIT:
+				clock_restore(); // The debugger gets the reset clock back
+				#if defined(DUAL_CONTROLLER)
+					bank2_wait(); // The core halts, finish the background erase first
+					flash_lock();
+				#endif
+				PARAMS->ACK = PARAMS->SEQ;
+				return;
+			default:
+				PARAMS->STATUS |= MASK_ERR; // Unknown job
+				break;
+		}
+
+		PARAMS->ACK = PARAMS->SEQ; // Job done
+	}
+}
+
+int loader(void) {
+
+	uint32_t i;
+	for (i=0;i < PARAMS_LEN ;i+=4) { // Clear parameters
+		mmio32(PARAMS_ADDR+i) = 0;
+	}
+	PARAMS->VERSION = LOADER_MAGIC | CAP_STREAM | CAP_MAILBOX | CAP_CRC | CAP_HASH | CAP_RLE | CAP_SKIP | CAP_BLANK | CAP_ERASE;
+	PARAMS->VERSION |= CAP_CLOCK | CAP_GEOMETRY;
+	#if defined(STM32F2) || defined(STM32F4)
+		PARAMS->RESULT = 0; // Whole sectors
+	#else
+		PARAMS->RESULT = FLASH_PAGE_SIZE; // Read by the host before its first job
+	#endif
+	#if defined(DUAL_CONTROLLER)
+		PARAMS->VERSION |= CAP_BACKGROUND;
+	#endif
+	#if defined(STM32F2) || defined(STM32F4)
+		PARAMS->VERSION |= CAP_PSIZE | CAP_SECTORS;
+	#endif
+
+	crc_init();
+
+    FLASH_SetLatency(FLASH_Latency_0);
+
+	while (1) {
+
+		asm volatile ("bkpt"); // Halt core after init and before writing to flash.
+		asm volatile ("nop");
+
+		clear_status();
+
+		if (PARAMS->CMD == CMD_MAILBOX)
+			mailbox();
+		else if (PARAMS->CMD == CMD_STREAM)
+			stream();
+		else
+			flash_chunk(PARAMS->DEST, BUFFER_ADDR, PARAMS->LEN);
+	}
+	return 0;
+}
@@ -105,7 +105,7 @@ if __name__ == "__main__":
   else:
     build_for.append(args.release)
 
-  ver = check_output(["grep \"VERSION =\" ../QStlink2.pro | awk '{ print $3 }' "], shell=True).replace('\n','')
+  ver = check_output(["grep \"VERSION =\" ../common.pri | awk '{ print $3 }' "], shell=True).replace('\n','')
   if not ver:
     print "Could not fetch last version"
     exit(1)
@@ -0,0 +1,109 @@
+#! /usr/bin/python3
+#
+#   This file is part of QSTLink2.
+#
+#   QSTLink2 is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 3 of the License, or
+#   (at your option) any later version.
+#
+#   QSTLink2 is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+
+# Compiles devices.xml into the built-in device table, sorted by chip ID.
+
+import argparse
+import sys
+import xml.etree.ElementTree as ET
+
+
+def parse_hex(el):
+    try:
+        return int(el.text.strip(), 16)
+    except (AttributeError, ValueError):
+        sys.exit("%s: failed to parse number" % el.tag)
+
+
+def c_string(s):
+    return '"%s"' % s.replace('\\', '\\\\').replace('"', '\\"')
+
+
+def values_table(name, values):
+    lines = ["static const DeviceValue %s[] = {" % name]
+    lines += ["    { %s, 0x%X }," % (c_string(k), v) for k, v in sorted(values.items())]
+    lines.append("};")
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compile devices.xml into a C++ table")
+    parser.add_argument("xml", help="devices.xml")
+    parser.add_argument("output", help="generated header")
+    args = parser.parse_args()
+
+    root = ET.parse(args.xml).getroot()
+
+    defaults = {}
+    for section in ("regs_default", "devices_default"):
+        for node in root.findall(section):
+            for el in node:
+                defaults[el.tag] = parse_hex(el)
+
+    devices = []
+    for node in root.findall("devices"):
+        for dev in node.findall("device"):
+            entry = {"type": dev.get("type", ""), "loader": "", "sectors": [], "values": {}}
+            for el in dev:
+                if el.tag == "loader":
+                    entry["loader"] = el.text.strip()
+                elif el.tag == "sectors":
+                    entry["sectors"] = [int(s.strip(), 16) for s in el.text.split(",")]
+                else:
+                    entry["values"][el.tag] = parse_hex(el)
+            if "chip_id" not in entry["values"]:
+                sys.exit("%s: no chip_id" % entry["type"])
+            devices.append(entry)
+
+    # Stable, the first description of a chip ID wins as with the XML file.
+    devices.sort(key=lambda d: d["values"]["chip_id"])
+
+    out = ["// Generated from devices.xml by compile_devices.py, do not edit.",
+           "#ifndef DEVICES_TABLE_H",
+           "#define DEVICES_TABLE_H",
+           "",
+           "namespace DeviceTable {",
+           ""]
+    out += values_table("DEFAULTS", defaults)
+    out.append("")
+    for i, dev in enumerate(devices):
+        out += values_table("VALUES_%d" % i, dev["values"])
+        if dev["sectors"]:
+            out.append("static const quint32 SECTORS_%d[] = { %s };" %
+                       (i, ", ".join("0x%X" % s for s in dev["sectors"])))
+        out.append("")
+
+    out.append("static const DeviceEntry DEVICES[] = {")
+    for i, dev in enumerate(devices):
+        sectors = ("SECTORS_%d" % i, len(dev["sectors"])) if dev["sectors"] else ("0", 0)
+        out.append("    { 0x%03X, %s, %s, VALUES_%d, %d, %s, %d }," %
+                   (dev["values"]["chip_id"], c_string(dev["type"]), c_string(dev["loader"]),
+                    i, len(dev["values"]), sectors[0], sectors[1]))
+    out.append("};")
+    out.append("")
+    out.append("static const int DEFAULTS_COUNT = %d;" % len(defaults))
+    out.append("static const int DEVICES_COUNT = %d;" % len(devices))
+    out.append("}")
+    out.append("")
+    out.append("#endif // DEVICES_TABLE_H")
+
+    with open(args.output, "w") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,285 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "cli.h"
+#include "gang.h"
+#include "daemon.h"
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+
+static quint8 verbose_level = 3; // Level = info by default
+static QElapsedTimer timer;
+
+static void myMessageOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg)
+{
+    QByteArray localMsg = msg.toLocal8Bit();
+    (void)context;
+    switch (type) {
+    case QtFatalMsg: // Always print!
+        fprintf(stderr, "%lld - Fatal: %s\n", timer.elapsed(), localMsg.constData());
+        abort();
+    case QtCriticalMsg:
+        if (verbose_level >= 1)
+            fprintf(stderr, "%lld - Error: %s\n", timer.elapsed(), localMsg.constData());
+        break;
+#if QT_VERSION >= 0x050500
+    case QtWarningMsg:
+        if (verbose_level >= 2)
+            fprintf(stderr, "%lld - Warning: %s\n", timer.elapsed(), localMsg.constData());
+        break;
+#endif
+    case QtInfoMsg: // Since there is no "Info" level before 5.5.0, we use qWarning which we alias with #define...
+        if (verbose_level >= 2)
+            fprintf(stdout, "%lld - Info: %s\n", timer.elapsed(), localMsg.constData());
+        break;
+    case QtDebugMsg:
+        if (verbose_level >= 5)
+            fprintf(stdout, "%lld - Debug: %s\n", timer.elapsed(), localMsg.constData());
+        break;
+    }
+}
+
+Cli::Cli(QObject *parent)
+    : QObject(parent)
+{
+    mStlink = new stlinkv2();
+    mTfThread = new transferThread();
+    QObject::connect(mTfThread, SIGNAL(sendLog(QString)), this, SLOT(log(QString)));
+}
+
+Cli::~Cli()
+{
+    mTfThread->wait();
+    delete mTfThread;
+    delete mStlink->mDevice;
+    delete mStlink;
+}
+
+void Cli::addOptions(QCommandLineParser *parser)
+{
+    parser->addOption(QCommandLineOption(QStringList() << "q"
+                                                       << "quiet",
+                                         "Supress output."));
+    parser->addOption(QCommandLineOption(QStringList() << "d"
+                                                       << "debug",
+                                         "Debug output."));
+    parser->addOption(QCommandLineOption(QStringList() << "c"
+                                                       << "cli",
+                                         "Commande line mode, always on for qstlink2-cli."));
+    parser->addOption(QCommandLineOption(QStringList() << "e"
+                                                       << "erase",
+                                         "Erase memory."));
+    parser->addOption(QCommandLineOption(QStringList() << "r"
+                                                       << "read",
+                                         "Read to file."));
+    parser->addOption(QCommandLineOption(QStringList() << "w"
+                                                       << "write",
+                                         "Write file."));
+    parser->addOption(QCommandLineOption(QStringList() << "v"
+                                                       << "verify",
+                                         "Verify file."));
+    parser->addOption(QCommandLineOption(QStringList() << "diff",
+                                         "Only rewrite the flash pages/sectors that differ from the file."));
+    parser->addOption(QCommandLineOption(QStringList() << "b"
+                                                       << "blank",
+                                         "Check that the flash is erased."));
+    parser->addOption(QCommandLineOption(QStringList() << "compress",
+                                         "Run-length encode the data sent to the loader."));
+    parser->addOption(QCommandLineOption(QStringList() << "vpp",
+                                         "External VPP is applied, program 64 bits at a time (F2/F4)."));
+    parser->addOption(QCommandLineOption(QStringList() << "gang",
+                                         "Write the file with every attached probe at once (CLI mode)."));
+    parser->addOption(QCommandLineOption(QStringList() << "stats",
+                                         "Print per-command probe statistics at the end (CLI mode)."));
+    parser->addOption(QCommandLineOption(QStringList() << "stats-json",
+                                         "Also write the probe statistics to a JSON file.", "file"));
+    parser->addOption(QCommandLineOption(QStringList() << "pipeline",
+                                         "Send the next probe command before reading the last answer, if the probe passes a test."));
+    parser->addOption(QCommandLineOption(QStringList() << "daemon",
+                                         "Keep the probes open and run the jobs posted on a local socket."));
+    parser->addOption(QCommandLineOption(QStringList() << "socket",
+                                         "Local socket name of the daemon, qstlink2 by default.", "name", "qstlink2"));
+    parser->addPositionalArgument("file", "Bin file");
+}
+
+void Cli::setupLogging(const QCommandLineParser &parser)
+{
+    if (!timer.isValid())
+        timer.start();
+    if (parser.isSet("quiet"))
+        verbose_level = 0;
+    else if (parser.isSet("debug")) {
+        verbose_level = 5;
+        QLoggingCategory::setFilterRules("qstlink2.trace.debug=true");
+    }
+    qDebug("Verbose level: %u", verbose_level);
+    qDebug("Version: %s", __QSTL_VER__);
+    qInstallMessageHandler(myMessageOutput);
+}
+
+int Cli::exec(const QCommandLineParser &parser)
+{
+    if (parser.isSet("daemon")) {
+        Daemon daemon;
+        if (!daemon.listen(parser.value("socket"), false))
+            return 1;
+        return QCoreApplication::exec();
+    }
+
+    const bool write_flash = parser.isSet("write");
+    const bool read_flash = parser.isSet("read");
+    const bool verify = parser.isSet("verify");
+    const bool diff = parser.isSet("diff");
+    const bool erase = parser.isSet("erase");
+    const bool blank = parser.isSet("blank");
+    const bool stats = parser.isSet("stats") || parser.isSet("stats-json");
+    QString path;
+    if (parser.positionalArguments().size() > 0)
+        path = parser.positionalArguments().at(0);
+
+    if (path.isEmpty() && !erase && !blank)
+        return 1;
+
+    if (!path.isEmpty()) {
+        qInfo() << "File Path:" << path;
+        qInfo() << "Erase:" << erase;
+        qInfo() << "Write:" << write_flash;
+        qInfo() << "Verify:" << verify;
+        qInfo() << "Diff:" << diff;
+    }
+
+    if (!path.isEmpty() && parser.isSet("gang") && write_flash) {
+        Gang g(&mDevices);
+        if (g.open(false) == 0) {
+            qCritical("No usable probe found");
+            return 1;
+        }
+        const int failed = g.send(path, verify, diff, parser.isSet("compress"), parser.isSet("vpp"));
+        g.close();
+        return failed > 0 ? 1 : 0;
+    }
+
+    mStlink->setStatsEnabled(stats);
+    if (!this->connect())
+        return 1;
+    if (parser.isSet("pipeline"))
+        mStlink->setPipelineDepth(STLink::MAX_PIPELINE_DEPTH);
+
+    bool res = true;
+    if (!path.isEmpty()) {
+        if (write_flash) {
+            qInfo("Sending %s", path.toStdString().c_str());
+            mStlink->resetMCU(); // We stop the MCU
+            mTfThread->setParams(mStlink, path, true, false);
+            mTfThread->setDiff(diff);
+            mTfThread->setCompress(parser.isSet("compress"));
+            mTfThread->setVpp(parser.isSet("vpp"));
+            res = this->runTransfer();
+        } else if (read_flash) {
+            qInfo("Saving to %s", path.toStdString().c_str());
+            mTfThread->setParams(mStlink, path, false, false);
+            res = this->runTransfer();
+        }
+        if (verify) {
+            qInfo("Verifying %s", path.toStdString().c_str());
+            mTfThread->setParams(mStlink, path, false, true);
+            res = this->runTransfer() && res;
+        }
+    } else {
+        if (erase) {
+            qInfo("Only erasing flash");
+            mStlink->hardResetMCU();
+            mStlink->resetMCU();
+            res = mStlink->unlockFlash() && mStlink->eraseFlash();
+        }
+        if (blank) {
+            qInfo("Blank checking flash");
+            mTfThread->setParams(mStlink, QString(), false, false);
+            mTfThread->setBlankCheck(true);
+            res = this->runTransfer() && res;
+        }
+    }
+
+    if (stats)
+        this->dumpStats(parser.value("stats-json"));
+    mStlink->disconnect();
+    return res ? 0 : 1;
+}
+
+void Cli::log(const QString &s)
+{
+    qInfo("%s", s.toStdString().c_str());
+}
+
+bool Cli::connect()
+{
+    qInfo("Searching Device...");
+
+    /* Try STL V2 first */
+    mStlink->setSTLinkIDs();
+    qint32 ret = mStlink->connect();
+
+    /* Try Nucleo */
+    if (ret < 0) {
+        mStlink->setNucleoIDs();
+        ret = mStlink->connect();
+    }
+
+    if (ret < 0) {
+        qCritical("ST Link V2 / Nucleo not found or unable to access it, USB error %d", ret);
+        return false;
+    }
+    qInfo("ST Link V2 / Nucleo found!");
+
+    if (!Gang::setupProbe(&mDevices, mStlink, false)) {
+        qCritical("Device not found in database!");
+        mStlink->disconnect();
+        return false;
+    }
+    qInfo("Device type: %s, %uKB flash", mStlink->mDevice->mType.toStdString().c_str(), mStlink->mDevice->desc().flash_size);
+    return true;
+}
+
+bool Cli::runTransfer()
+{
+    // Connected before start(), finished() can't be missed.
+    QEventLoop loop;
+    QObject::connect(mTfThread, SIGNAL(finished()), &loop, SLOT(quit()));
+    mTfThread->start();
+    loop.exec();
+    return mTfThread->result();
+}
+
+void Cli::dumpStats(const QString &path)
+{
+    const QStringList lines = mStlink->stats()->summary();
+    for (int i = 0; i < lines.size(); i++)
+        qInfo("%s", lines.at(i).toStdString().c_str());
+
+    if (path.isEmpty())
+        return;
+    QJsonObject obj = mStlink->stats()->toJson();
+    obj.insert("stlink_version", (qint64)mStlink->mVersion.stlink);
+    obj.insert("jtag_version", (qint64)mStlink->mVersion.jtag);
+    obj.insert("api_version", (qint64)mStlink->mVersion.api);
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(QJsonDocument(obj).toJson()) < 0)
+        qCritical("Could not write %s", path.toStdString().c_str());
+}
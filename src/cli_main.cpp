@@ -0,0 +1,38 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include "cli.h"
+#include "compat.h"
+
+int main(int argc, char *argv[])
+{
+    Q_INIT_RESOURCE(loaders);
+    QCoreApplication::setApplicationName("QSTlink2");
+    QCoreApplication::setApplicationVersion(__QSTL_VER__);
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QString().asprintf("QSTlink2 v%s, command line", __QSTL_VER__));
+    parser.addHelpOption();
+    Cli::addOptions(&parser);
+    parser.process(a);
+    Cli::setupLogging(parser);
+
+    Cli cli;
+    return cli.exec(parser);
+}
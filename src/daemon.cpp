@@ -0,0 +1,311 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "daemon.h"
+#include "gang.h"
+#include <QJsonDocument>
+#include <QJsonArray>
+
+Daemon::Daemon(QObject *parent)
+    : QObject(parent)
+{
+    mServer = new QLocalServer(this);
+    mJtag = false;
+    QObject::connect(mServer, SIGNAL(newConnection()), this, SLOT(newClient()));
+}
+
+Daemon::~Daemon()
+{
+    mServer->close();
+    this->closeProbes();
+}
+
+bool Daemon::listen(const QString &name, bool jtag)
+{
+    mJtag = jtag;
+    qInfo("%d probe(s) ready", this->openProbes());
+
+    QLocalServer::removeServer(name); // Left over by a crashed instance
+    if (!mServer->listen(name)) {
+        qCritical("Could not listen on %s: %s", name.toStdString().c_str(), mServer->errorString().toStdString().c_str());
+        return false;
+    }
+    qInfo("Waiting for jobs on %s", mServer->fullServerName().toStdString().c_str());
+    return true;
+}
+
+int Daemon::openProbes()
+{
+    const QUsbDevice::IdList ids = stlinkv2::listProbes();
+    for (int i = 0; i < ids.size(); i++) {
+        Probe probe;
+        probe.name = QString().asprintf("bus %u port %u", ids.at(i).bus, ids.at(i).port);
+        probe.stlink = new stlinkv2();
+        probe.stlink->setProbe(ids.at(i));
+
+        const qint32 ret = probe.stlink->connect();
+        if (ret < 0) {
+            qCritical("%s: unable to access the probe, USB error %d", probe.name.toStdString().c_str(), ret);
+            delete probe.stlink;
+            continue;
+        }
+        if (!Gang::setupProbe(&mDevices, probe.stlink, mJtag)) {
+            qCritical("%s: device not found in database!", probe.name.toStdString().c_str());
+            delete probe.stlink->mDevice;
+            delete probe.stlink;
+            continue;
+        }
+        qInfo("%s: %s, %uKB flash", probe.name.toStdString().c_str(),
+              probe.stlink->mDevice->mType.toStdString().c_str(), probe.stlink->mDevice->desc().flash_size);
+
+        probe.thread = new transferThread();
+        probe.busy = false;
+        QObject::connect(probe.thread, SIGNAL(sendProgress(quint32)), this, SLOT(jobProgress(quint32)));
+        QObject::connect(probe.thread, SIGNAL(sendLog(QString)), this, SLOT(jobLog(QString)));
+        QObject::connect(probe.thread, SIGNAL(finished()), this, SLOT(jobFinished()));
+        mProbes.append(probe);
+    }
+    return mProbes.size();
+}
+
+void Daemon::closeProbes()
+{
+    for (int i = 0; i < mProbes.size(); i++) {
+        Probe &probe = mProbes[i];
+        probe.thread->wait();
+        delete probe.thread;
+        delete probe.stlink->mDevice;
+        delete probe.stlink;
+    }
+    mProbes.clear();
+}
+
+void Daemon::newClient()
+{
+    while (mServer->hasPendingConnections()) {
+        QLocalSocket *client = mServer->nextPendingConnection();
+        QObject::connect(client, SIGNAL(readyRead()), this, SLOT(clientData()));
+        QObject::connect(client, SIGNAL(disconnected()), this, SLOT(clientGone()));
+    }
+}
+
+void Daemon::clientData()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket *>(this->sender());
+    if (!client)
+        return;
+
+    while (client->canReadLine()) {
+        const QByteArray line = client->readLine().trimmed();
+        if (line.isEmpty())
+            continue;
+        const QJsonDocument doc = QJsonDocument::fromJson(line);
+        if (!doc.isObject()) {
+            QJsonObject msg;
+            msg.insert("event", QString("error"));
+            msg.insert("message", QString("Invalid JSON request"));
+            this->reply(client, QJsonValue(), msg);
+            continue;
+        }
+        this->handle(client, doc.object());
+    }
+}
+
+void Daemon::clientGone()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket *>(this->sender());
+    // Queued jobs are dropped, the running ones complete without reporting.
+    for (int i = 0; i < mProbes.size(); i++) {
+        QQueue<Job> &jobs = mProbes[i].jobs;
+        if (mProbes.at(i).busy && !jobs.isEmpty() && jobs.head().client == client)
+            jobs.head().client = 0;
+        for (int j = mProbes.at(i).busy ? 1 : 0; j < jobs.size();) {
+            if (jobs.at(j).client == client)
+                jobs.removeAt(j);
+            else
+                j++;
+        }
+    }
+    if (client)
+        client->deleteLater();
+}
+
+void Daemon::handle(QLocalSocket *client, const QJsonObject &req)
+{
+    const QJsonValue id = req.value("id");
+    const QString cmd = req.value("cmd").toString();
+    QJsonObject msg;
+
+    if (cmd == "list") {
+        this->reply(client, id, this->probeList());
+        return;
+    }
+    if (cmd == "rescan") {
+        for (int i = 0; i < mProbes.size(); i++) {
+            if (!mProbes.at(i).jobs.isEmpty()) {
+                msg.insert("event", QString("error"));
+                msg.insert("message", QString("Jobs are pending"));
+                this->reply(client, id, msg);
+                return;
+            }
+        }
+        this->closeProbes();
+        this->openProbes();
+        this->reply(client, id, this->probeList());
+        return;
+    }
+
+    const int index = req.value("probe").toInt(0);
+    if (cmd != "write" && cmd != "verify" && cmd != "read" && cmd != "blank") {
+        msg.insert("event", QString("error"));
+        msg.insert("message", QString("Unknown command: ") + cmd);
+    } else if (index < 0 || index >= mProbes.size()) {
+        msg.insert("event", QString("error"));
+        msg.insert("message", QString("No probe %1").arg(index));
+    } else if (cmd != "blank" && req.value("path").toString().isEmpty()) {
+        msg.insert("event", QString("error"));
+        msg.insert("message", QString("No path"));
+    }
+    if (!msg.isEmpty()) {
+        this->reply(client, id, msg);
+        return;
+    }
+
+    Job job;
+    job.client = client;
+    job.id = id;
+    job.cmd = cmd;
+    job.path = req.value("path").toString();
+    job.verify = req.value("verify").toBool(false);
+    job.diff = req.value("diff").toBool(false);
+    job.compress = req.value("compress").toBool(false);
+    job.vpp = req.value("vpp").toBool(false);
+
+    Probe &probe = mProbes[index];
+    probe.jobs.enqueue(job);
+    msg.insert("event", QString("queued"));
+    msg.insert("probe", index);
+    msg.insert("position", probe.jobs.size() - 1);
+    this->reply(client, id, msg);
+    this->startNext(probe);
+}
+
+void Daemon::reply(QLocalSocket *client, const QJsonValue &id, QJsonObject msg)
+{
+    if (!client)
+        return;
+    if (!id.isUndefined())
+        msg.insert("id", id);
+    client->write(QJsonDocument(msg).toJson(QJsonDocument::Compact) + '\n');
+}
+
+QJsonObject Daemon::probeList() const
+{
+    QJsonArray probes;
+    for (int i = 0; i < mProbes.size(); i++) {
+        const DeviceInfo *device = mProbes.at(i).stlink->mDevice;
+        QJsonObject probe;
+        probe.insert("probe", i);
+        probe.insert("name", mProbes.at(i).name);
+        probe.insert("device", device->mType);
+        probe.insert("chip_id", (qint64)device->desc().chip_id);
+        probe.insert("flash_size", (qint64)device->desc().flash_size);
+        probe.insert("busy", mProbes.at(i).busy);
+        probes.append(probe);
+    }
+    QJsonObject msg;
+    msg.insert("probes", probes);
+    return msg;
+}
+
+void Daemon::startNext(Probe &probe)
+{
+    if (probe.busy || probe.jobs.isEmpty())
+        return;
+    const Job &job = probe.jobs.head();
+    probe.busy = true;
+
+    if (job.cmd == "write") {
+        probe.stlink->resetMCU(); // We stop the MCU
+        probe.thread->setParams(probe.stlink, job.path, true, job.verify);
+    } else if (job.cmd == "verify") {
+        probe.thread->setParams(probe.stlink, job.path, false, true);
+    } else if (job.cmd == "read") {
+        probe.thread->setParams(probe.stlink, job.path, false, false);
+    } else {
+        probe.thread->setParams(probe.stlink, QString(), false, false);
+        probe.thread->setBlankCheck(true);
+    }
+    probe.thread->setDiff(job.diff);
+    probe.thread->setCompress(job.compress);
+    probe.thread->setVpp(job.vpp);
+
+    QJsonObject msg;
+    msg.insert("event", QString("started"));
+    this->reply(job.client, job.id, msg);
+    probe.thread->start();
+}
+
+int Daemon::probeOf(QObject *thread) const
+{
+    for (int i = 0; i < mProbes.size(); i++) {
+        if (mProbes.at(i).thread == thread)
+            return i;
+    }
+    return -1;
+}
+
+void Daemon::jobProgress(quint32 p)
+{
+    const int index = this->probeOf(this->sender());
+    if (index < 0 || !mProbes.at(index).busy)
+        return;
+    const Job &job = mProbes.at(index).jobs.head();
+    QJsonObject msg;
+    msg.insert("event", QString("progress"));
+    msg.insert("value", (int)p);
+    this->reply(job.client, job.id, msg);
+}
+
+void Daemon::jobLog(const QString &s)
+{
+    const int index = this->probeOf(this->sender());
+    if (index < 0 || !mProbes.at(index).busy)
+        return;
+    const Job &job = mProbes.at(index).jobs.head();
+    QJsonObject msg;
+    msg.insert("event", QString("log"));
+    msg.insert("message", s);
+    this->reply(job.client, job.id, msg);
+}
+
+void Daemon::jobFinished()
+{
+    const int index = this->probeOf(this->sender());
+    if (index < 0 || !mProbes.at(index).busy)
+        return;
+    Probe &probe = mProbes[index];
+    const Job job = probe.jobs.dequeue();
+    probe.busy = false;
+
+    QJsonObject msg;
+    msg.insert("event", QString("done"));
+    msg.insert("result", probe.thread->result());
+    this->reply(job.client, job.id, msg);
+    qInfo("%s: %s %s: %s", probe.name.toStdString().c_str(), job.cmd.toStdString().c_str(),
+          job.path.toStdString().c_str(), probe.thread->result() ? "PASS" : "FAIL");
+    this->startNext(probe);
+}
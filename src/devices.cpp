@@ -15,52 +15,94 @@ This file is part of QSTLink2.
     along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "devices.h"
+#include "devices_table.h"
+#include <algorithm>
+#include <string.h>
+
+/* Values with a descriptor field */
+static const struct {
+    const char *key;
+    quint32 DeviceDescriptor::*field;
+} DESCRIPTOR_FIELDS[] = {
+    { "chip_id", &DeviceDescriptor::chip_id },
+    { "flash_base", &DeviceDescriptor::flash_base },
+    { "flash_size", &DeviceDescriptor::flash_size },
+    { "flash_size_reg", &DeviceDescriptor::flash_size_reg },
+    { "flash_page_size", &DeviceDescriptor::flash_page_size },
+    { "flash_bank_size", &DeviceDescriptor::flash_bank_size },
+    { "flash_erased", &DeviceDescriptor::flash_erased },
+    { "flash_int_reg", &DeviceDescriptor::flash_int_reg },
+    { "SR_OFFSET", &DeviceDescriptor::sr_offset },
+    { "CR_OFFSET", &DeviceDescriptor::cr_offset },
+    { "KEYR_OFFSET", &DeviceDescriptor::keyr_offset },
+    { "SR_BSY", &DeviceDescriptor::sr_bsy },
+    { "CR_LOCK", &DeviceDescriptor::cr_lock },
+    { "sram_base", &DeviceDescriptor::sram_base },
+    { "buffer_size", &DeviceDescriptor::buffer_size },
+    { "loader_clock", &DeviceDescriptor::loader_clock },
+};
 
 DeviceInfo::DeviceInfo(QObject *parent)
     : QObject(parent)
 {
     mType = "UNKNOWN";
     mLoaderFile = "UNKNOWN";
+    memset(&mDesc, 0, sizeof(mDesc));
 }
 
 DeviceInfo::DeviceInfo(const DeviceInfo *device)
 {
     mType = device->mType;
+    mLoaderFile = device->mLoaderFile;
     mMap = device->mMap;
+    mDesc = device->mDesc;
+    mSectors = device->mSectors;
+}
+
+void DeviceInfo::insert(QString k, quint32 v)
+{
+    mMap.insert(k, v);
+    for (size_t i = 0; i < sizeof(DESCRIPTOR_FIELDS) / sizeof(DESCRIPTOR_FIELDS[0]); i++) {
+        if (k == QLatin1String(DESCRIPTOR_FIELDS[i].key)) {
+            mDesc.*DESCRIPTOR_FIELDS[i].field = v;
+            return;
+        }
+    }
 }
 
 DeviceInfoList::DeviceInfoList(QObject *parent)
     : QObject(parent)
 {
     mLoaded = false;
-    qDebug("Loading device list.");
+    mBuiltin = false;
+    mCurDevice = 0;
     mDoc = new QDomDocument("stlink");
+    mDefaultDevice = new DeviceInfo(this);
 
-    /* Try local path first */
+    /* A local devices.xml overrides the built-in list */
     QFile file("devices.xml");
-
-#ifndef WIN32
-    /* Try default directory on Unix */
-    if (!file.open(QIODevice::ReadOnly)) {
-        file.setFileName("/usr/share/qstlink2/devices.xml");
+    if (file.open(QIODevice::ReadOnly)) {
+        qInfo("Loading the device list from devices.xml.");
+        mLoaded = this->loadXml(&file);
+        file.close();
+        return;
     }
-#endif
 
-    /* Load from resource */
-    if (!file.open(QIODevice::ReadOnly)) {
-        qInfo("Could not open the devices.xml file. Using internal data.");
+    for (int i = 0; i < DeviceTable::DEFAULTS_COUNT; i++)
+        mDefaultDevice->insert(DeviceTable::DEFAULTS[i].key, DeviceTable::DEFAULTS[i].value);
+    mBuiltin = true;
+    mLoaded = true;
+    qDebug("Using the built-in device list.");
+}
 
-        file.setFileName(":/devices.xml");
-    }
-    if (!mDoc->setContent(&file)) {
-        file.close();
+bool DeviceInfoList::loadXml(QFile *file)
+{
+    if (!mDoc->setContent(file)) {
         qCritical("Devices list failed to load.");
-        return;
+        return false;
     }
-    file.close();
     qInfo("Devices list loaded.");
 
-    mDefaultDevice = new DeviceInfo(this);
     bool isInt;
     QDomElement docElem = mDoc->documentElement();
     QDomNode n = docElem.firstChild();
@@ -112,6 +154,16 @@ DeviceInfoList::DeviceInfoList(QObject *parent)
                                device.tagName().toStdString().c_str(),
                                device.attribute("type").toStdString().c_str(),
                                el.tagName().toStdString().c_str());
+                        if (el.tagName() == "sectors") {
+                            const QStringList sectors = el.text().split(',');
+                            for (int s = 0; s < sectors.count(); s++) {
+                                mDevices.last()->mSectors.append(sectors.at(s).trimmed().toUInt(&isInt, 16));
+                                if (!isInt)
+                                    qCritical("%s: Failed to parse number!", el.tagName().toStdString().c_str());
+                            }
+                            continue;
+                        }
+
                         mDevices.last()->insert(el.tagName(), el.text().toUInt(&isInt, 16));
                         if (!isInt && el.tagName() != "loader")
                             qCritical("%s: Failed to parse number!", el.tagName().toStdString().c_str());
@@ -120,14 +172,29 @@ DeviceInfoList::DeviceInfoList(QObject *parent)
                             mDevices.last()->mLoaderFile = el.text();
                         }
                     }
+                    // The first description of a chip ID wins.
+                    const quint32 chip_id = mDevices.last()->desc().chip_id;
+                    if (!mIndex.contains(chip_id))
+                        mIndex.insert(chip_id, mDevices.last());
                 }
             }
         }
         n = n.nextSibling();
     }
+    return true;
+}
 
-    mLoaded = true;
-    return;
+DeviceInfo *DeviceInfoList::fromTable(const DeviceEntry &entry)
+{
+    DeviceInfo *device = new DeviceInfo(mDefaultDevice); // Copy from the default device.
+    device->mType = entry.type;
+    device->mLoaderFile = entry.loader;
+    for (int i = 0; i < entry.value_count; i++)
+        device->insert(entry.values[i].key, entry.values[i].value);
+    for (int i = 0; i < entry.sector_count; i++)
+        device->mSectors.append(entry.sectors[i]);
+    mDevices.append(device);
+    return device;
 }
 
 bool DeviceInfoList::IsLoaded() const
@@ -139,22 +206,29 @@ bool DeviceInfoList::IsLoaded() const
 bool DeviceInfoList::search(const quint32 chip_id)
 {
     qDebug("Looking for: 0x%03X", chip_id);
-    for (int i = 0; i < mDevices.count(); i++) {
-        if (mDevices.at(i)->value("chip_id") == chip_id) {
-            mCurDevice = mDevices.at(i);
-            qDebug("Found chipID");
-            //qDebug() << mCurDevice->repr();
-            return true;
+    DeviceInfo *device = mIndex.value(chip_id);
+    if (!device && mBuiltin) {
+        const DeviceEntry *end = DeviceTable::DEVICES + DeviceTable::DEVICES_COUNT;
+        const DeviceEntry *entry = std::lower_bound(DeviceTable::DEVICES, end, chip_id,
+                                                    [](const DeviceEntry &e, quint32 id) { return e.chip_id < id; });
+        if (entry != end && entry->chip_id == chip_id) {
+            device = this->fromTable(*entry);
+            mIndex.insert(chip_id, device);
         }
     }
-    qCritical("Did not find chipID!");
-    return false;
+    if (!device) {
+        qCritical("Did not find chipID!");
+        return false;
+    }
+    mCurDevice = device;
+    qDebug("Found chipID");
+    return true;
 }
 
 quint16 DeviceInfoList::getDevicesCount() const
 {
 
-    return mDevices.count();
+    return mBuiltin ? DeviceTable::DEVICES_COUNT : mDevices.count();
 }
 
 QString DeviceInfo::repr(void) const
@@ -170,3 +244,107 @@ QString DeviceInfo::repr(void) const
     tmp.append("\r\nLoader: " + mLoaderFile);
     return tmp;
 }
+
+QList<FlashRange> DeviceInfo::eraseUnits(quint32 from, quint32 to) const
+{
+
+    QList<FlashRange> units;
+    const quint32 page_size = mDesc.flash_page_size;
+    if (from >= to || (mSectors.isEmpty() && !page_size))
+        return units;
+
+    if (mSectors.isEmpty()) {
+        const quint32 offset = (from - mDesc.flash_base) % page_size;
+        for (quint32 base = from - offset; base < to; base += page_size)
+            units.append(FlashRange(base, page_size));
+        return units;
+    }
+
+    quint32 base = mDesc.flash_base;
+    for (int i = 0; base < to; i++) {
+        const quint32 size = mSectors.at(qMin(i, mSectors.size() - 1));
+        if (base + size > from)
+            units.append(FlashRange(base, size));
+        base += size;
+    }
+    return units;
+}
+
+QList<FlashRange> DeviceInfo::eraseUnits(const QList<FlashRange> &ranges) const
+{
+
+    QList<FlashRange> units;
+    for (int r = 0; r < ranges.size(); r++) {
+        const QList<FlashRange> range_units = this->eraseUnits(ranges.at(r).first, ranges.at(r).first + ranges.at(r).second);
+        for (int u = 0; u < range_units.size(); u++) {
+            if (units.isEmpty() || units.last().first < range_units.at(u).first) // Ranges may share a unit
+                units.append(range_units.at(u));
+        }
+    }
+    return units;
+}
+
+QList<FlashRange> DeviceInfo::banks() const
+{
+
+    QList<FlashRange> banks;
+    const quint32 base = mDesc.flash_base;
+    const quint32 size = mDesc.flash_size * 1024;
+    const quint32 bank_size = mDesc.flash_bank_size;
+    if (!bank_size || bank_size >= size) {
+        banks.append(FlashRange(base, size));
+        return banks;
+    }
+    for (quint32 offset = 0; offset < size; offset += bank_size)
+        banks.append(FlashRange(base + offset, qMin(bank_size, size - offset)));
+    return banks;
+}
+
+QList<FlashRange> DeviceInfo::erasePlan(const QList<FlashRange> &ranges) const
+{
+
+    const QList<FlashRange> units = this->eraseUnits(ranges);
+    const QList<FlashRange> banks = this->banks();
+    QList<FlashRange> plan;
+    int u = 0;
+    for (int b = 0; b < banks.size(); b++) {
+        const quint32 bank_end = banks.at(b).first + banks.at(b).second;
+        QList<FlashRange> bank_units;
+        quint32 covered = 0;
+        for (; u < units.size() && units.at(u).first < bank_end; u++) {
+            if (units.at(u).first < banks.at(b).first) { // Before the banks, keep as is
+                plan.append(units.at(u));
+                continue;
+            }
+            bank_units.append(units.at(u));
+            covered += units.at(u).second;
+        }
+        // One mass erase instead of a unit per unit erase of the whole bank.
+        if (covered >= banks.at(b).second && banks.at(b).second > 0)
+            plan.append(banks.at(b));
+        else
+            plan.append(bank_units);
+    }
+    for (; u < units.size(); u++) // Past the banks
+        plan.append(units.at(u));
+    return plan;
+}
+
+int DeviceInfo::sectorNumber(quint32 addr) const
+{
+
+    const int bank2_first = 16; // F42x/F43x bank 2 sector numbers
+    const quint32 bank_size = mDesc.flash_bank_size;
+    quint32 base = mDesc.flash_base;
+    int first = 0, number = 0; // First index and number of the current bank
+    for (int i = 0; !mSectors.isEmpty() && base <= addr; i++) {
+        if (bank_size && base == mDesc.flash_base + bank_size) {
+            first = i;
+            number = bank2_first;
+        }
+        if (base == addr)
+            return number + i - first;
+        base += mSectors.at(qMin(i, mSectors.size() - 1));
+    }
+    return -1;
+}
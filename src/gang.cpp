@@ -0,0 +1,133 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "gang.h"
+
+Gang::Gang(DeviceInfoList *devices, QObject *parent)
+    : QObject(parent)
+{
+    mDevices = devices;
+}
+
+Gang::~Gang()
+{
+    this->close();
+}
+
+int Gang::open(bool jtag)
+{
+    this->close();
+    const QUsbDevice::IdList ids = stlinkv2::listProbes();
+    qInfo("%d probe(s) found", ids.size());
+
+    for (int i = 0; i < ids.size(); i++) {
+        Probe probe;
+        probe.name = QString().asprintf("bus %u port %u", ids.at(i).bus, ids.at(i).port);
+        probe.stlink = new stlinkv2();
+        probe.stlink->setProbe(ids.at(i));
+
+        const qint32 ret = probe.stlink->connect();
+        if (ret < 0) {
+            qCritical("%s: unable to access the probe, USB error %d", probe.name.toStdString().c_str(), ret);
+            delete probe.stlink;
+            continue;
+        }
+        if (!setupProbe(mDevices, probe.stlink, jtag)) {
+            qCritical("%s: device not found in database!", probe.name.toStdString().c_str());
+            delete probe.stlink->mDevice;
+            delete probe.stlink;
+            continue;
+        }
+        qInfo("%s: %s, %uKB flash", probe.name.toStdString().c_str(),
+              probe.stlink->mDevice->mType.toStdString().c_str(), probe.stlink->mDevice->desc().flash_size);
+
+        probe.thread = new transferThread();
+        // Direct, the threads run while the caller blocks in send(). Each probe logs through its own lambda,
+        // sender() is not valid in a slot called from another thread.
+        const QString name = probe.name;
+        QObject::connect(probe.thread, &transferThread::sendLog, this, [name](const QString &s) {
+            qInfo("%s: %s", name.toStdString().c_str(), s.toStdString().c_str());
+        }, Qt::DirectConnection);
+        mProbes.append(probe);
+    }
+    return mProbes.size();
+}
+
+void Gang::close()
+{
+    for (int i = 0; i < mProbes.size(); i++) {
+        Probe &probe = mProbes[i];
+        probe.thread->wait();
+        delete probe.thread;
+        delete probe.stlink->mDevice;
+        delete probe.stlink;
+    }
+    mProbes.clear();
+}
+
+int Gang::send(const QString &path, bool verify, bool diff, bool compress, bool vpp)
+{
+    for (int i = 0; i < mProbes.size(); i++) {
+        Probe &probe = mProbes[i];
+        probe.stlink->resetMCU(); // We stop the MCU
+        probe.thread->setParams(probe.stlink, path, true, verify);
+        probe.thread->setDiff(diff);
+        probe.thread->setCompress(compress);
+        probe.thread->setVpp(vpp);
+        probe.thread->start();
+    }
+
+    int failed = 0;
+    for (int i = 0; i < mProbes.size(); i++) {
+        const Probe &probe = mProbes.at(i);
+        probe.thread->wait();
+        if (!probe.thread->result())
+            failed++;
+    }
+
+    qInfo("Gang programming results:");
+    for (int i = 0; i < mProbes.size(); i++) {
+        const Probe &probe = mProbes.at(i);
+        qInfo("  %s: %s", probe.name.toStdString().c_str(), probe.thread->result() ? "PASS" : "FAIL");
+    }
+    qInfo("%d/%d board(s) programmed", mProbes.size() - failed, mProbes.size());
+    return failed;
+}
+
+bool Gang::setupProbe(DeviceInfoList *devices, stlinkv2 *stlink, bool jtag)
+{
+    stlink->mDevice = 0;
+    stlink->getVersion();
+    stlink->getMode();
+    stlink->setExitModeDFU();
+    if (jtag)
+        stlink->setModeJTAG();
+    else
+        stlink->setModeSWD();
+    QThread::msleep(100);
+    stlink->getStatus();
+
+    stlink->getCoreID();
+    stlink->resetMCU();
+    stlink->getChipID();
+    if (!devices->search(stlink->mChipId))
+        return false;
+
+    // The boards may differ in flash size, each probe owns its description.
+    stlink->mDevice = new DeviceInfo(devices->mCurDevice);
+    stlink->mDevice->insert("flash_size", stlink->readFlashSize());
+    return true;
+}
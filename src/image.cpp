@@ -0,0 +1,397 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "image.h"
+#include <QFileInfo>
+#include <QtEndian>
+#include <algorithm>
+#include <string.h>
+
+ImageSource::ImageSource(QObject *parent)
+    : QObject(parent)
+{
+    mData = 0;
+    mFileSize = 0;
+    mFormat = FormatBin;
+    mAlign = 1;
+    mFill = (char)0xFF;
+}
+
+ImageSource::~ImageSource()
+{
+    this->close();
+}
+
+bool ImageSource::open(const QString &path, quint32 base, quint32 align, char fill)
+{
+    this->close();
+    mAlign = qMax(align, (quint32)1);
+    mFill = fill;
+    mFile.setFileName(path);
+    if (!mFile.open(QIODevice::ReadOnly))
+        return false;
+
+    mFileSize = mFile.size();
+    if (mFileSize == 0)
+        return true;
+
+    mData = mFile.map(0, mFileSize);
+    if (!mData) {
+        qDebug("Could not map %s, reading it instead", path.toStdString().c_str());
+        mBuffer = mFile.readAll();
+        if (mBuffer.size() != mFileSize) {
+            this->close();
+            return false;
+        }
+        mData = (uchar *)mBuffer.data();
+    }
+
+    const QString suffix = QFileInfo(path).suffix().toLower();
+    if (mFileSize >= 4 && memcmp(mData, "\x7f" "ELF", 4) == 0)
+        mFormat = FormatElf;
+    else if (suffix == "hex" || suffix == "ihex")
+        mFormat = FormatHex;
+    else if (suffix == "srec" || suffix == "s19" || suffix == "s28" || suffix == "s37" || suffix == "mot")
+        mFormat = FormatSrec;
+    else
+        mFormat = FormatBin;
+
+    bool res = true;
+    switch (mFormat) {
+    case FormatElf:
+        res = this->parseElf();
+        break;
+    case FormatHex:
+        res = this->parseHex();
+        break;
+    case FormatSrec:
+        res = this->parseSrec();
+        break;
+    default:
+        this->addData(base, QByteArray::fromRawData((const char *)mData, mFileSize));
+        break;
+    }
+    if (!res || !this->finalize()) {
+        this->close();
+        return false;
+    }
+
+    for (int i = 0; i < mSegments.size(); i++)
+        qDebug("Image segment 0x%08X - 0x%08X", mSegments.at(i).addr, mSegments.at(i).addr + mSegments.at(i).data.size());
+    return true;
+}
+
+void ImageSource::close()
+{
+    mSegments.clear();
+    if (mData && mBuffer.isEmpty())
+        mFile.unmap(mData);
+    mData = 0;
+    mBuffer.clear();
+    mFileSize = 0;
+    mFormat = FormatBin;
+    if (mFile.isOpen())
+        mFile.close();
+}
+
+ImageSource::Format ImageSource::format() const
+{
+    return mFormat;
+}
+
+qint64 ImageSource::size() const
+{
+    qint64 size = 0;
+    for (int i = 0; i < mSegments.size(); i++)
+        size += mSegments.at(i).data.size();
+    return size;
+}
+
+quint32 ImageSource::start() const
+{
+    return mSegments.isEmpty() ? 0 : mSegments.first().addr;
+}
+
+quint32 ImageSource::end() const
+{
+    return mSegments.isEmpty() ? 0 : mSegments.last().addr + mSegments.last().data.size();
+}
+
+QList<FlashRange> ImageSource::ranges() const
+{
+    QList<FlashRange> ranges;
+    for (int i = 0; i < mSegments.size(); i++)
+        ranges.append(FlashRange(mSegments.at(i).addr, mSegments.at(i).data.size()));
+    return ranges;
+}
+
+QByteArray ImageSource::view(quint32 addr, qint64 len) const
+{
+    if (len <= 0)
+        return QByteArray();
+    for (int i = 0; i < mSegments.size(); i++) {
+        const ImageSegment &seg = mSegments.at(i);
+        if (addr < seg.addr || addr >= seg.addr + seg.data.size())
+            continue;
+        const qint64 offset = addr - seg.addr;
+        return QByteArray::fromRawData(seg.data.constData() + offset, qMin(len, seg.data.size() - offset));
+    }
+    return QByteArray();
+}
+
+QByteArray ImageSource::extract(quint32 addr, quint32 len, char fill) const
+{
+    QByteArray buf(len, fill);
+    for (int i = 0; i < mSegments.size(); i++) {
+        const ImageSegment &seg = mSegments.at(i);
+        const quint32 from = qMax(addr, seg.addr);
+        const quint32 to = qMin(addr + len, seg.addr + (quint32)seg.data.size());
+        if (from < to)
+            memcpy(buf.data() + (from - addr), seg.data.constData() + (from - seg.addr), to - from);
+    }
+    return buf;
+}
+
+bool ImageSource::parseElf()
+{
+    const uchar *elf = mData;
+    if (mFileSize < 52 || elf[4] != 1 || elf[5] != 1) { // ELFCLASS32, ELFDATA2LSB
+        qCritical("Only 32 bit little endian ELF files are supported");
+        return false;
+    }
+
+    const quint32 phoff = qFromLittleEndian<quint32>(elf + 28);
+    const quint16 phentsize = qFromLittleEndian<quint16>(elf + 42);
+    const quint16 phnum = qFromLittleEndian<quint16>(elf + 44);
+    if (phentsize < 32 || phoff + (qint64)phnum * phentsize > mFileSize) {
+        qCritical("ELF program headers out of bounds");
+        return false;
+    }
+
+    for (int i = 0; i < phnum; i++) {
+        const uchar *ph = elf + phoff + (i * phentsize);
+        const quint32 type = qFromLittleEndian<quint32>(ph);
+        const quint32 offset = qFromLittleEndian<quint32>(ph + 4);
+        const quint32 paddr = qFromLittleEndian<quint32>(ph + 12);
+        const quint32 filesz = qFromLittleEndian<quint32>(ph + 16);
+        if (type != 1 || filesz == 0) // PT_LOAD with contents only
+            continue;
+        if (offset + (qint64)filesz > mFileSize) {
+            qCritical("ELF segment %d out of bounds", i);
+            return false;
+        }
+        // Load address, initialised data lives in flash and is copied at startup.
+        mSegments.append(ImageSegment());
+        mSegments.last().addr = paddr;
+        mSegments.last().data = QByteArray::fromRawData((const char *)elf + offset, filesz);
+    }
+    return true;
+}
+
+bool ImageSource::parseHex()
+{
+    const QList<QByteArray> lines = QByteArray::fromRawData((const char *)mData, mFileSize).split('\n');
+    quint32 upper = 0;
+    for (int l = 0; l < lines.size(); l++) {
+        const QByteArray line = lines.at(l).trimmed();
+        if (line.isEmpty())
+            continue;
+
+        const QByteArray rec = QByteArray::fromHex(line.mid(1));
+        if (line.at(0) != ':' || rec.size() < 5 || rec.size() != (uchar)rec.at(0) + 5) {
+            qCritical("Invalid HEX record at line %d", l + 1);
+            return false;
+        }
+        quint8 sum = 0;
+        for (int i = 0; i < rec.size(); i++)
+            sum += rec.at(i);
+        if (sum != 0) {
+            qCritical("HEX checksum error at line %d", l + 1);
+            return false;
+        }
+
+        const uchar *r = (const uchar *)rec.constData();
+        const quint32 addr = (r[1] << 8) | r[2];
+        switch (r[3]) {
+        case 0x00: // Data
+            this->addData(upper + addr, rec.mid(4, r[0]));
+            break;
+        case 0x01: // End of file
+            return true;
+        case 0x02: // Extended segment address
+        case 0x04: // Extended linear address
+            if (r[0] != 2) {
+                qCritical("Invalid HEX record at line %d", l + 1);
+                return false;
+            }
+            upper = ((r[4] << 8) | r[5]) << (r[3] == 0x02 ? 4 : 16);
+            break;
+        default: // Start addresses
+            break;
+        }
+    }
+    return true;
+}
+
+bool ImageSource::parseSrec()
+{
+    const QList<QByteArray> lines = QByteArray::fromRawData((const char *)mData, mFileSize).split('\n');
+    for (int l = 0; l < lines.size(); l++) {
+        const QByteArray line = lines.at(l).trimmed();
+        if (line.isEmpty())
+            continue;
+
+        const QByteArray rec = QByteArray::fromHex(line.mid(2));
+        if (line.size() < 4 || line.at(0) != 'S' || rec.size() < 3 || rec.size() != (uchar)rec.at(0) + 1) {
+            qCritical("Invalid S-record at line %d", l + 1);
+            return false;
+        }
+        quint8 sum = 0;
+        for (int i = 0; i < rec.size(); i++)
+            sum += rec.at(i);
+        if (sum != 0xFF) {
+            qCritical("S-record checksum error at line %d", l + 1);
+            return false;
+        }
+
+        int addr_len;
+        switch (line.at(1)) {
+        case '1':
+            addr_len = 2;
+            break;
+        case '2':
+            addr_len = 3;
+            break;
+        case '3':
+            addr_len = 4;
+            break;
+        default: // Header, count and start address records
+            continue;
+        }
+        if (rec.size() < addr_len + 2) {
+            qCritical("Invalid S-record at line %d", l + 1);
+            return false;
+        }
+
+        quint32 addr = 0;
+        for (int i = 0; i < addr_len; i++)
+            addr = (addr << 8) | (uchar)rec.at(1 + i);
+        this->addData(addr, rec.mid(1 + addr_len, rec.size() - addr_len - 2));
+    }
+    return true;
+}
+
+void ImageSource::addData(quint32 addr, const QByteArray &data)
+{
+    if (data.isEmpty())
+        return;
+    if (!mSegments.isEmpty() && mSegments.last().addr + mSegments.last().data.size() == addr) {
+        mSegments.last().data.append(data);
+        return;
+    }
+    mSegments.append(ImageSegment());
+    mSegments.last().addr = addr;
+    mSegments.last().data = data;
+}
+
+bool ImageSource::finalize()
+{
+    const quint32 mask = mAlign - 1;
+    std::sort(mSegments.begin(), mSegments.end(),
+              [](const ImageSegment &a, const ImageSegment &b) { return a.addr < b.addr; });
+
+    for (int i = 1; i < mSegments.size(); i++) {
+        const quint32 prev_end = mSegments.at(i - 1).addr + mSegments.at(i - 1).data.size();
+        if (mSegments.at(i).addr < prev_end) {
+            qCritical("Overlapping image data at 0x%08X", mSegments.at(i).addr);
+            return false;
+        }
+        // Segments sharing a program word are merged, the gap filled.
+        if ((mSegments.at(i).addr & ~mask) < ((prev_end + mask) & ~mask)) {
+            mSegments[i - 1].data.append(QByteArray(mSegments.at(i).addr - prev_end, mFill));
+            mSegments[i - 1].data.append(mSegments.at(i).data);
+            mSegments.removeAt(i--);
+        }
+    }
+
+    // Whole words only, the loader programs a word at a time.
+    for (int i = 0; i < mSegments.size(); i++) {
+        ImageSegment &seg = mSegments[i];
+        const quint32 head = seg.addr & mask;
+        const quint32 tail = (0 - (seg.addr + seg.data.size())) & mask;
+        if (head) {
+            seg.data.prepend(QByteArray(head, mFill));
+            seg.addr -= head;
+        }
+        if (tail)
+            seg.data.append(QByteArray(tail, mFill));
+    }
+    return true;
+}
+
+ImageSink::ImageSink(QObject *parent)
+    : QObject(parent)
+{
+    mData = 0;
+    mSize = 0;
+}
+
+ImageSink::~ImageSink()
+{
+    this->close();
+}
+
+bool ImageSink::open(const QString &path, qint64 size)
+{
+    this->close();
+    mFile.setFileName(path);
+    if (!mFile.open(QIODevice::ReadWrite | QIODevice::Truncate))
+        return false;
+    if (!mFile.resize(size)) {
+        mFile.close();
+        return false;
+    }
+
+    mSize = size;
+    if (mSize > 0)
+        mData = mFile.map(0, mSize);
+    if (!mData)
+        qDebug("Could not map %s, writing it instead", path.toStdString().c_str());
+    return true;
+}
+
+void ImageSink::close()
+{
+    if (mData)
+        mFile.unmap(mData);
+    mData = 0;
+    mSize = 0;
+    if (mFile.isOpen())
+        mFile.close();
+}
+
+bool ImageSink::write(qint64 offset, const QByteArray &buf)
+{
+    if (offset < 0 || offset >= mSize)
+        return false;
+    const qint64 len = qMin((qint64)buf.size(), mSize - offset);
+
+    if (mData) {
+        memcpy(mData + offset, buf.constData(), len);
+        return true;
+    }
+    return mFile.seek(offset) && mFile.write(buf.constData(), len) == len;
+}
@@ -1,7 +1,10 @@
 #include "loader.h"
+#include <QtEndian>
 
 LoaderData::LoaderData(QObject *parent)
     : QObject(parent)
+    , mParams(Loader::Addr::LEGACY_PARAMS)
+    , mBuffer(Loader::Addr::LEGACY_BUFFER)
 {
 }
 
@@ -19,11 +22,102 @@ bool LoaderData::loadBin(const QString &path)
     mData = file.readAll();
     file.close();
 
+    // Images without a header keep the historical fixed layout.
+    using namespace Loader::Header;
+    const uchar *p = (const uchar *)mData.constData();
+    if (mData.size() >= SIZE && qFromLittleEndian<quint32>(p + OFFSET_MAGIC) == MAGIC) {
+        mParams = qFromLittleEndian<quint32>(p + OFFSET_PARAMS);
+        mBuffer = qFromLittleEndian<quint32>(p + OFFSET_BUFFER);
+    } else {
+        qWarning("Loader %s has no header, it predates the extended protocol (rebuild loaders/bin)", path.toStdString().c_str());
+        mParams = Loader::Addr::LEGACY_PARAMS;
+        mBuffer = Loader::Addr::LEGACY_BUFFER;
+    }
+    qDebug("Loader parameters at 0x%08X, buffer at 0x%08X", mParams, mBuffer);
+
     return true;
 }
 
+quint32 Loader::crc32(const QByteArray &data)
+{
+
+    // Built once, static initialization is thread safe and transfer threads run in parallel.
+    struct Table {
+        quint32 v[256];
+    };
+    static const Table table = []() {
+        Table t;
+        for (quint32 i = 0; i < 256; i++) {
+            quint32 c = i << 24;
+            for (int b = 0; b < 8; b++)
+                c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+            t.v[i] = c;
+        }
+        return t;
+    }();
+
+    QByteArray padded(data);
+    if (padded.size() % 4)
+        padded.append(QByteArray(4 - (padded.size() % 4), (char)0xFF));
+
+    quint32 crc = 0xFFFFFFFF;
+    const uchar *p = (const uchar *)padded.constData();
+    for (int i = 0; i < padded.size(); i += 4) {
+        // The CRC unit takes words MSB first, bytes are stored little endian.
+        for (int b = 3; b >= 0; b--)
+            crc = (crc << 8) ^ table.v[(crc >> 24) ^ p[i + b]];
+    }
+    return crc;
+}
+
+static void rleLiterals(QByteArray *out, const QByteArray &data, int from, int to)
+{
+    for (int i = from; i < to; i += Loader::Chunk::RLE_MAX_LITERAL) {
+        const int len = qMin(to - i, (int)Loader::Chunk::RLE_MAX_LITERAL);
+        out->append((char)(len - 1));
+        out->append(data.constData() + i, len);
+    }
+}
+
+QByteArray Loader::rleEncode(const QByteArray &data)
+{
+    using namespace Loader::Chunk;
+    QByteArray out;
+    out.reserve(data.size() + (data.size() / RLE_MAX_LITERAL) + 1);
+
+    int literal = 0; // Start of the pending literals
+    int i = 0;
+    while (i < data.size()) {
+        int run = 1;
+        while (i + run < data.size() && run < RLE_MAX_RUN && data.at(i + run) == data.at(i))
+            run++;
+
+        if (run >= RLE_MIN_RUN) {
+            rleLiterals(&out, data, literal, i);
+            out.append((char)(RLE_REPEAT + run - RLE_MIN_RUN));
+            out.append(data.at(i));
+            literal = i + run;
+        }
+        i += run;
+    }
+    rleLiterals(&out, data, literal, data.size());
+    return out;
+}
+
 QByteArray &LoaderData::refData(void)
 {
 
     return mData;
 }
+
+quint32 LoaderData::params(void) const
+{
+
+    return mParams;
+}
+
+quint32 LoaderData::buffer(void) const
+{
+
+    return mBuffer;
+}
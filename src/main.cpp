@@ -16,54 +16,14 @@ This file is part of QSTLink2.
 */
 #include <QApplication>
 #include <mainwindow.h>
+#include "cli.h"
 #include <QStringList>
-#include <QDebug>
-#include <QFile>
 #include <QCommandLineParser>
-#include <QElapsedTimer>
 #include "compat.h"
 
-bool show = true;
-bool write_flash = false, read_flash = false, erase = false, verify = false;
-QString path;
-
-static quint8 verbose_level = 3; // Level = info by default
-static QElapsedTimer timer;
-
-#if QT_VERSION >= 0x050000
-static void myMessageOutput(QtMsgType type, const QMessageLogContext &context, const QString &msg)
-{
-    QByteArray localMsg = msg.toLocal8Bit();
-    (void)context;
-    switch (type) {
-    case QtFatalMsg: // Always print!
-        fprintf(stderr, "%lld - Fatal: %s\n", timer.elapsed(), localMsg.constData());
-        abort();
-    case QtCriticalMsg:
-        if (verbose_level >= 1)
-            fprintf(stderr, "%lld - Error: %s\n", timer.elapsed(), localMsg.constData());
-        break;
-#if QT_VERSION >= 0x050500
-    case QtWarningMsg:
-        if (verbose_level >= 2)
-            fprintf(stderr, "%lld - Warning: %s\n", timer.elapsed(), localMsg.constData());
-        break;
-#endif
-    case QtInfoMsg: // Since there is no "Info" level before 5.5.0, we use qWarning which we alias with #define...
-        if (verbose_level >= 2)
-            fprintf(stdout, "%lld - Info: %s\n", timer.elapsed(), localMsg.constData());
-        break;
-    case QtDebugMsg:
-        if (verbose_level >= 5)
-            fprintf(stdout, "%lld - Debug: %s\n", timer.elapsed(), localMsg.constData());
-        break;
-    }
-}
-#endif
-
 int main(int argc, char *argv[])
 {
-    timer.start();
+    Q_INIT_RESOURCE(loaders);
     QCoreApplication::setApplicationName("QSTlink2");
     QCoreApplication::setApplicationVersion(__QSTL_VER__);
     QApplication a(argc, argv);
@@ -71,57 +31,11 @@ int main(int argc, char *argv[])
     QCommandLineParser parser;
     parser.setApplicationDescription(QString().asprintf("QSTlink2 v%s", __QSTL_VER__));
     parser.addHelpOption();
-    parser.addOption(QCommandLineOption(QStringList() << "q"
-                                                      << "quiet",
-                                        "Supress output."));
-    parser.addOption(QCommandLineOption(QStringList() << "d"
-                                                      << "debug",
-                                        "Debug output."));
-    parser.addOption(QCommandLineOption(QStringList() << "c"
-                                                      << "cli",
-                                        "Commande line mode."));
-    parser.addOption(QCommandLineOption(QStringList() << "e"
-                                                      << "erase",
-                                        "Erase memory."));
-    parser.addOption(QCommandLineOption(QStringList() << "r"
-                                                      << "read",
-                                        "Read to file."));
-    parser.addOption(QCommandLineOption(QStringList() << "w"
-                                                      << "write",
-                                        "Write file."));
-    parser.addOption(QCommandLineOption(QStringList() << "v"
-                                                      << "verify",
-                                        "Verify file."));
-    parser.addPositionalArgument("file", "Bin file");
+    Cli::addOptions(&parser);
     parser.process(a);
+    Cli::setupLogging(parser);
 
-    if (parser.isSet("quiet"))
-        verbose_level = 0;
-    else if (parser.isSet("debug"))
-        verbose_level = 5;
-    if (parser.isSet("cli"))
-        show = false;
-    if (parser.isSet("erase"))
-        erase = true;
-    if (parser.isSet("write"))
-        write_flash = true;
-    if (parser.isSet("read"))
-        read_flash = true;
-    if (parser.isSet("verify"))
-        verify = true;
-
-    if (parser.positionalArguments().size() > 0)
-        path = parser.positionalArguments().at(0);
-
-    qDebug("Verbose level: %u", verbose_level);
-    qDebug("Version: %s", __QSTL_VER__);
-    qInstallMessageHandler(myMessageOutput);
-    MainWindow *w = new MainWindow;
-    if (show) {
-        w->show();
-    }
-
-    else {
+    if (parser.isSet("cli") || parser.isSet("daemon")) {
 #if defined(WINDOWS)
         // detach from the current console window
         FreeConsole();
@@ -134,45 +48,11 @@ int main(int argc, char *argv[])
         freopen("CON", "w", stderr);
         freopen("CON", "r", stdin);
 #endif
-        if (!path.isEmpty()) {
-
-            qInfo() << "File Path:" << path;
-            qInfo() << "Erase:" << erase;
-            qInfo() << "Write:" << write_flash;
-            qInfo() << "Verify:" << verify;
-            if (!w->connect()) {
-                return 1;
-            }
-            if (write_flash) {
-                w->send(path);
-                while (w->mTfThread->isRunning()) {
-                    QThread::msleep(100);
-                }
-            } else if (read_flash) {
-                w->receive(path);
-                while (w->mTfThread->isRunning()) {
-                    QThread::msleep(100);
-                }
-            }
-            if (verify) {
-                w->verify(path);
-                while (w->mTfThread->isRunning()) {
-                    QThread::msleep(100);
-                }
-            }
-            QThread::msleep(300);
-            w->disconnect();
-            w->close();
-            return 0;
-        } else if (erase) {
-            qInfo("Only erasing flash");
-            if (!w->connect())
-                return 1;
-            w->eraseFlash();
-            w->disconnect();
-            return 0;
-        }
-        return 1;
+        Cli cli;
+        return cli.exec(parser);
     }
+
+    MainWindow *w = new MainWindow;
+    w->show();
     return a.exec();
 }
@@ -201,16 +201,17 @@ void MainWindow::updateLoaderPct(quint32 p)
 void MainWindow::send()
 {
     mFilename.clear();
-    mFilename = QFileDialog::getOpenFileName(this, "Open file", "", "Binary Files (*.bin)");
+    mFilename = QFileDialog::getOpenFileName(this, "Open file", "", "Firmware Files (*.bin *.elf *.axf *.hex *.ihex *.srec *.s19 *.s28 *.s37 *.mot);;Binary Files (*.bin)");
     if (!mFilename.isNull()) {
-        QFile file(mFilename);
-        if (!file.open(QIODevice::ReadOnly)) {
+        const quint32 flash_base = mStlink->mDevice->desc().flash_base;
+        ImageSource image;
+        if (!image.open(mFilename, flash_base)) {
             qCritical("Could not open the file.");
             return;
         }
-        this->log("Size: " + QString::number(file.size() / 1024) + "KB");
+        this->log("Size: " + QString::number(image.size() / 1024) + "KB");
 
-        if (file.size() > mStlink->mDevice->value("flash_size") * 1024) {
+        if (image.end() > flash_base + mStlink->mDevice->desc().flash_size * 1024) {
             if (QMessageBox::question(this, "Flash size exceeded", "The file is bigger than the flash size!\n\nThe flash memory will be erased and the new file programmed, continue?", QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes) {
                 return;
             }
@@ -219,7 +220,7 @@ void MainWindow::send()
                 return;
             }
         }
-        file.close();
+        image.close();
 
         this->send(mFilename);
         mLastAction = ACTION_SEND;
@@ -273,7 +274,7 @@ void MainWindow::verify()
 {
     qDebug("Verify flash");
     mFilename.clear();
-    mFilename = QFileDialog::getOpenFileName(this, "Open file", "", "Binary Files (*.bin)");
+    mFilename = QFileDialog::getOpenFileName(this, "Open file", "", "Firmware Files (*.bin *.elf *.axf *.hex *.ihex *.srec *.s19 *.s28 *.s37 *.mot);;Binary Files (*.bin)");
     if (!mFilename.isNull()) {
         QFile file(mFilename);
         if (!file.open(QIODevice::ReadOnly)) {
@@ -319,6 +320,19 @@ void MainWindow::verify(const QString &path)
     mTfThread->start();
 }
 
+void MainWindow::blankCheck()
+{
+    this->log("Blank checking flash");
+    mUi->tabw_info->setCurrentIndex(3);
+    mUi->pgb_transfer->setValue(0);
+    mUi->l_progress->setText("Starting blank check...");
+
+    // Transfer thread
+    mTfThread->setParams(mStlink, QString(), false, false);
+    mTfThread->setBlankCheck(true);
+    mTfThread->start();
+}
+
 void MainWindow::eraseFlash()
 {
     mStlink->hardResetMCU();
@@ -334,6 +348,10 @@ void MainWindow::haltMCU()
     mStlink->haltMCU();
     QThread::msleep(100);
     this->getStatus();
+    if (mStlink->readAllRegisters())
+        this->log(QString().asprintf("PC: 0x%08X SP: 0x%08X LR: 0x%08X xPSR: 0x%08X",
+                                     mStlink->getRegister(Cortex::CoreReg::PC), mStlink->getRegister(Cortex::CoreReg::SP),
+                                     mStlink->getRegister(Cortex::CoreReg::LR), mStlink->getRegister(Cortex::CoreReg::XPSR)));
 }
 
 void MainWindow::runMCU()
@@ -454,8 +472,8 @@ bool MainWindow::getMCU()
         qInfo() << "Device type: " << mStlink->mDevice->mType;
 
         mUi->le_type->setText(mStlink->mDevice->mType);
-        mUi->le_chipid->setText("0x" + QString::number(mStlink->mDevice->value("chip_id"), 16));
-        mUi->le_flashbase->setText("0x" + QString::number(mStlink->mDevice->value("flash_base"), 16));
+        mUi->le_chipid->setText("0x" + QString::number(mStlink->mDevice->desc().chip_id, 16));
+        mUi->le_flashbase->setText("0x" + QString::number(mStlink->mDevice->desc().flash_base, 16));
         //this->ui->le_flashsize->setText(QString::number((*this->stlink->device)["flash_size"]/1024)+"KB");
 
         mUi->le_stlver->setText(QString::number(mStlink->mVersion.stlink));
@@ -468,7 +486,7 @@ bool MainWindow::getMCU()
             mUi->le_swimver->setToolTip("Not supported");
 
         mStlink->mDevice->insert("flash_size", mStlink->readFlashSize());
-        mUi->le_flashsize->setText(QString::number(mStlink->mDevice->value("flash_size")) + "KB");
+        mUi->le_flashsize->setText(QString::number(mStlink->mDevice->desc().flash_size) + "KB");
 
         return true;
     }
@@ -0,0 +1,207 @@
+/*
+This file is part of QSTLink2.
+
+    QSTLink2 is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    QSTLink2 is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "probestats.h"
+#include "stlinkv2.h"
+#include <QJsonArray>
+#include <string.h>
+
+const quint32 ProbeStats::BOUNDS[BUCKETS - 1] = { 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000 };
+
+ProbeStats::ProbeStats(QObject *parent)
+    : QObject(parent)
+{
+}
+
+void ProbeStats::clear()
+{
+    mEntries.clear();
+}
+
+void ProbeStats::record(const QByteArray &cmd, qint64 bytes_out, qint64 bytes_in, qint64 nsecs)
+{
+    const quint16 op = opcode(cmd);
+    if (!mEntries.contains(op)) {
+        Entry blank;
+        memset(&blank, 0, sizeof(blank));
+        mEntries.insert(op, blank);
+    }
+    Entry &e = mEntries[op];
+    e.count++;
+    e.bytes_out += bytes_out;
+    e.bytes_in += bytes_in;
+    e.total_ns += nsecs;
+    e.max_ns = qMax(e.max_ns, nsecs);
+
+    int bucket = 0;
+    while (bucket < BUCKETS - 1 && nsecs >= (qint64)BOUNDS[bucket] * 1000)
+        bucket++;
+    e.histogram[bucket]++;
+}
+
+quint16 ProbeStats::opcode(const QByteArray &cmd)
+{
+    if (cmd.isEmpty())
+        return 0;
+    const quint8 cmd0 = cmd.at(0);
+    if ((cmd0 == STLink::Cmd::DebugCommand || cmd0 == STLink::Cmd::DFUCommand) && cmd.size() > 1)
+        return (cmd0 << 8) | (quint8)cmd.at(1);
+    return cmd0 << 8;
+}
+
+QString ProbeStats::opcodeName(quint16 opcode)
+{
+    using namespace STLink::Cmd;
+    const quint8 cmd0 = opcode >> 8;
+    const quint8 cmd1 = opcode & 0xFF;
+
+    if (cmd0 == DFUCommand && cmd1 == DFUExit)
+        return "DFUExit";
+    if (cmd0 == DFUCommand && cmd1 == DFUGetVersion)
+        return "DFUGetVersion";
+    if (cmd0 == GetVersion)
+        return "GetVersion";
+    if (cmd0 == GetCurrentMode)
+        return "GetCurrentMode";
+    if (cmd0 == GetTargetVoltage)
+        return "GetTargetVoltage";
+    if (cmd0 != DebugCommand)
+        return QString().asprintf("0x%02X 0x%02X", cmd0, cmd1);
+
+    switch (cmd1) {
+    case Dbg::EnterJTAG:
+        return "EnterJTAG";
+    case Dbg::GetStatus:
+        return "GetStatus";
+    case Dbg::ForceDebug:
+        return "ForceDebug";
+    case Dbg::ResetSys:
+        return "ResetSys";
+    case Dbg::ReadAllRegs:
+        return "ReadAllRegs";
+    case Dbg::ReadReg:
+        return "ReadReg";
+    case Dbg::WriteReg:
+        return "WriteReg";
+    case Dbg::ReadMem32bit:
+        return "ReadMem32bit";
+    case Dbg::WriteMem32bit:
+        return "WriteMem32bit";
+    case Dbg::RunCore:
+        return "RunCore";
+    case Dbg::StepCore:
+        return "StepCore";
+    case Dbg::SetFP:
+        return "SetFP";
+    case Dbg::ReadMem8bit:
+        return "ReadMem8bit";
+    case Dbg::WriteMem8bit:
+        return "WriteMem8bit";
+    case Dbg::WriteDbgReg:
+        return "WriteDbgReg";
+    case Dbg::Enter:
+        return "Enter";
+    case Dbg::Exit:
+        return "Exit";
+    case Dbg::ReadCoreID:
+        return "ReadCoreID";
+    case Dbg::EnterSWD:
+        return "EnterSWD";
+    case DbgV2::Enter:
+        return "EnterV2";
+    case DbgV2::ReadIDCode:
+        return "ReadIDCodeV2";
+    case DbgV2::ResetSys:
+        return "ResetSysV2";
+    case DbgV2::ReadReg:
+        return "ReadRegV2";
+    case DbgV2::WriteReg:
+        return "WriteRegV2";
+    case DbgV2::WriteDbgReg:
+        return "WriteDbgRegV2";
+    case DbgV2::ReadDbgReg:
+        return "ReadDbgRegV2";
+    case DbgV2::ReadAllRegs:
+        return "ReadAllRegsV2";
+    case DbgV2::HardReset:
+        return "HardResetV2";
+    default:
+        return QString().asprintf("0x%02X 0x%02X", cmd0, cmd1);
+    }
+}
+
+QStringList ProbeStats::summary() const
+{
+    QStringList lines;
+    quint32 count = 0;
+    qint64 total_ns = 0;
+    lines.append(QString().asprintf("%-16s %8s %10s %10s %9s %9s %10s",
+                                    "Command", "Count", "Out KB", "In KB", "Mean us", "Max us", "Total ms"));
+    for (QMap<quint16, Entry>::const_iterator it = mEntries.constBegin(); it != mEntries.constEnd(); ++it) {
+        const Entry &e = it.value();
+        count += e.count;
+        total_ns += e.total_ns;
+        lines.append(QString().asprintf("%-16s %8u %10.1f %10.1f %9lld %9lld %10.1f",
+                                        opcodeName(it.key()).toStdString().c_str(), e.count,
+                                        e.bytes_out / 1024.0, e.bytes_in / 1024.0,
+                                        e.total_ns / e.count / 1000, e.max_ns / 1000, e.total_ns / 1000000.0));
+
+        QString histogram = "    ";
+        for (int i = 0; i < BUCKETS; i++) {
+            if (!e.histogram[i])
+                continue;
+            if (i < BUCKETS - 1)
+                histogram += QString().asprintf(" <%uus:%u", BOUNDS[i], e.histogram[i]);
+            else
+                histogram += QString().asprintf(" >=%uus:%u", BOUNDS[i - 1], e.histogram[i]);
+        }
+        lines.append(histogram);
+    }
+    lines.append(QString().asprintf("%u commands, %.1fms spent on the probe", count, total_ns / 1000000.0));
+    return lines;
+}
+
+QJsonObject ProbeStats::toJson() const
+{
+    QJsonArray bounds;
+    for (int i = 0; i < BUCKETS - 1; i++)
+        bounds.append((qint64)BOUNDS[i]);
+
+    QJsonArray commands;
+    for (QMap<quint16, Entry>::const_iterator it = mEntries.constBegin(); it != mEntries.constEnd(); ++it) {
+        const Entry &e = it.value();
+        QJsonArray histogram;
+        for (int i = 0; i < BUCKETS; i++)
+            histogram.append((qint64)e.histogram[i]);
+
+        QJsonObject cmd;
+        cmd.insert("opcode", QString().asprintf("%04X", it.key()));
+        cmd.insert("name", opcodeName(it.key()));
+        cmd.insert("count", (qint64)e.count);
+        cmd.insert("bytes_out", (qint64)e.bytes_out);
+        cmd.insert("bytes_in", (qint64)e.bytes_in);
+        cmd.insert("total_us", e.total_ns / 1000);
+        cmd.insert("mean_us", e.total_ns / e.count / 1000);
+        cmd.insert("max_us", e.max_ns / 1000);
+        cmd.insert("histogram", histogram);
+        commands.append(cmd);
+    }
+
+    QJsonObject obj;
+    obj.insert("histogram_bounds_us", bounds);
+    obj.insert("commands", commands);
+    return obj;
+}
@@ -15,18 +15,27 @@ This file is part of QSTLink2.
     along with QSTLink2.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "stlinkv2.h"
+#include <QElapsedTimer>
+
+Q_LOGGING_CATEGORY(lcTrace, "qstlink2.trace", QtWarningMsg)
 
 //using namespace std;
 
 stlinkv2::stlinkv2(QObject *parent)
-    : QThread(parent), mUsbDevice(new QUsbDevice), mUsbInfo(new QUsbInfo), mUsbEndpointIn(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_IN)), mUsbEndpointStlinkOut(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_OUT)), mUsbEndpointNucleoOut(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_OUT_NUCLEO)), mUsbEndpointOut(mUsbEndpointStlinkOut)
+    : QThread(parent), mUsbDevice(new QUsbDevice), mUsbInfo(new QUsbInfo), mUsbEndpointIn(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_IN)), mUsbEndpointStlinkOut(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_OUT)), mUsbEndpointNucleoOut(new QUsbEndpoint(mUsbDevice, QUsbEndpoint::bulkEndpoint, USB_PIPE_OUT_NUCLEO)), mUsbEndpointOut(mUsbEndpointStlinkOut), mStats(new ProbeStats(this))
 
 {
     mModeId = -1;
     mCoreId = 0;
     mChipId = 0;
+    mDevice = 0;
     mVersion.stlink = 0;
     mConnected = false;
+    mLoaderSeq = 0;
+    mRegsValid = false;
+    mStatsEnabled = false;
+    mStatsStart = mStatsLast = mStatsOut = mStatsIn = 0;
+    mPipelineDepth = STLink::DEFAULT_PIPELINE_DEPTH;
 
     QUsbDevice::Config cfg;
     QUsbDevice::Id f1, f2;
@@ -97,6 +106,34 @@ void stlinkv2::setNucleoIDs()
     mUsbDevice->setId(id);
 }
 
+void stlinkv2::setProbe(const QUsbDevice::Id &id)
+{
+    if (id.pid == USB_NUCLEO_PID)
+        mUsbEndpointOut = mUsbEndpointNucleoOut;
+    else
+        mUsbEndpointOut = mUsbEndpointStlinkOut;
+    mUsbDevice->setId(id);
+}
+
+QUsbDevice::IdList stlinkv2::listProbes(void)
+{
+    QUsbDevice::IdList probes;
+    const QUsbDevice::IdList list = QUsbDevice::devices();
+    for (int i = 0; i < list.size(); i++) {
+        const QUsbDevice::Id &id = list.at(i);
+        if (id.vid == USB_ST_VID && (id.pid == USB_STLINKv2_PID || id.pid == USB_NUCLEO_PID))
+            probes.append(id);
+    }
+    return probes;
+}
+
+quint16 stlinkv2::getMaxReadSize() const
+{
+    if (mVersion.api == 1)
+        return STLink::MAX_READ_V1;
+    return STLink::MAX_READ_V2;
+}
+
 bool stlinkv2::isConnected()
 {
     return mConnected;
@@ -148,8 +185,8 @@ quint8 stlinkv2::getStatus()
     } else {
         quint32 st;
         st = this->readDbgRegister(Cortex::Reg::DCB_DHCSR);
-        qDebug("Status Reg: 0x%08X", st);
-        qDebug() << QString::number(st, 2);
+        qTrace("Status Reg: 0x%08X", st);
+        qTrace() << QString::number(st, 2);
 
         if (st & Cortex::Status::HALT)
             return STLink::Status::HALTED;
@@ -217,15 +254,33 @@ quint32 stlinkv2::readFlashSize()
     PrintFuncName();
     QByteArray buf;
 
-    this->readMem32(&buf, mDevice->value("flash_size_reg"));
+    this->readMem32(&buf, mDevice->desc().flash_size_reg);
     mDevice->insert("flash_size", qFromLittleEndian<quint32>((uchar *)buf.data()));
     if (mChipId == STM32::ChipID::F4 || mChipId == STM32::ChipID::F4_HD) {
-        mDevice->insert("flash_size", mDevice->value("flash_size") >> 16);
+        mDevice->insert("flash_size", mDevice->desc().flash_size >> 16);
     } else {
-        mDevice->insert("flash_size", mDevice->value("flash_size") & 0xFFFF);
+        mDevice->insert("flash_size", mDevice->desc().flash_size & 0xFFFF);
     }
-    qInfo("Flash size: %d KB", mDevice->value("flash_size"));
-    return mDevice->value("flash_size");
+    qInfo("Flash size: %d KB", mDevice->desc().flash_size);
+    return mDevice->desc().flash_size;
+}
+
+double stlinkv2::getTargetVoltage()
+{
+    PrintFuncName();
+    QByteArray buf;
+
+    if (mVersion.jtag < 13) // Added in the J13 firmwares
+        return 0;
+    if (this->command(&buf, STLink::Cmd::GetTargetVoltage, 0, 8) < 8)
+        return 0;
+    const quint32 ref = qFromLittleEndian<quint32>((uchar *)buf.data());
+    const quint32 vdd = qFromLittleEndian<quint32>((uchar *)buf.data() + 4);
+    if (ref == 0)
+        return 0;
+    const double voltage = 2 * vdd * 1.2 / ref;
+    qInfo("Target voltage: %.2fV", voltage);
+    return voltage;
 }
 
 void stlinkv2::setModeJTAG()
@@ -262,6 +317,7 @@ void stlinkv2::resetMCU()
 {
     PrintFuncName();
     QByteArray buf;
+    mRegsValid = false;
     if (mVersion.api == 1)
         this->debugCommand(&buf, STLink::Cmd::Dbg::ResetSys, 0, 2);
     else
@@ -272,6 +328,7 @@ void stlinkv2::hardResetMCU()
 {
     PrintFuncName();
     QByteArray buf;
+    mRegsValid = false;
     this->command(&buf, STLink::Cmd::Reset, 0, 8);
     this->debugCommand(&buf, STLink::Cmd::DbgV2::HardReset, 0x02, 2);
 }
@@ -281,6 +338,7 @@ void stlinkv2::runMCU()
     PrintFuncName();
     QByteArray buf;
     using namespace Cortex::Control;
+    mRegsValid = false;
     if (mVersion.api == 1)
         this->debugCommand(&buf, STLink::Cmd::Dbg::RunCore, 0, 2);
     else {
@@ -293,6 +351,7 @@ void stlinkv2::stepMCU()
     PrintFuncName();
     QByteArray buf;
     using namespace Cortex::Control;
+    mRegsValid = false;
     if (mVersion.api == 1)
         this->debugCommand(&buf, STLink::Cmd::Dbg::StepCore, 0, 2);
     else {
@@ -308,12 +367,51 @@ void stlinkv2::haltMCU()
     PrintFuncName();
     QByteArray buf;
     using namespace Cortex::Control;
+    mRegsValid = false;
     if (mVersion.api == 1)
         this->debugCommand(&buf, STLink::Cmd::Dbg::ForceDebug, 0, 2);
     else {
         this->writeDbgRegister(Cortex::Reg::DCB_DHCSR, DBGKEY | HALT | DEBUGEN);
-        while (!(this->readDbgRegister(Cortex::Reg::DCB_DHCSR) & Cortex::Status::HALT))
-            QThread::msleep(50);
+        const qint64 res = this->waitHalted(STLink::HALT_TIMEOUT);
+        if (res == STLink::WAIT_ERROR)
+            qCritical("Failed to read the core status while halting it");
+        else if (res < 0)
+            qCritical("The core didn't halt within %ums", STLink::HALT_TIMEOUT);
+    }
+}
+
+qint64 stlinkv2::waitHalted(quint32 timeout)
+{
+    QElapsedTimer timer;
+    quint32 delay = 0;
+    timer.start();
+    for (int polls = 1;; polls++) {
+        bool running;
+        if (mVersion.api == 1) {
+            const quint8 st = this->getStatus();
+            if (st != STLink::Status::RUNNING && st != STLink::Status::HALTED)
+                return STLink::WAIT_ERROR;
+            running = st == STLink::Status::RUNNING;
+        } else {
+            // Not getStatus(), too verbose for a tight loop. DEBUGEN is set, 0 is a failed read.
+            const quint32 st = this->readDbgRegister(Cortex::Reg::DCB_DHCSR);
+            if (!st)
+                return STLink::WAIT_ERROR;
+            running = !(st & Cortex::Status::HALT);
+        }
+        if (!running) {
+            const qint64 elapsed = timer.nsecsElapsed() / 1000;
+            qTrace("Halted after %lldus, %d polls", elapsed, polls);
+            return elapsed;
+        }
+
+        const qint64 remaining = timeout - timer.elapsed();
+        if (remaining <= 0)
+            return STLink::WAIT_TIMEOUT;
+        if (polls < STLink::HALT_SPIN_POLLS)
+            continue;
+        delay = delay ? qMin(delay * 2, STLink::HALT_BACKOFF_MAX) : STLink::HALT_BACKOFF_MIN;
+        QThread::usleep(qMin((qint64)delay, remaining * 1000));
     }
 }
 
@@ -348,7 +446,7 @@ bool stlinkv2::unlockFlash()
     QByteArray buf;
     uchar endian_buf[4];
 
-    const quint32 addr = mDevice->value("flash_int_reg") + mDevice->value("KEYR_OFFSET");
+    const quint32 addr = mDevice->desc().flashKEYR();
 
     qToLittleEndian(STM32::Flash::KEY1, endian_buf);
     buf.append((const char *)endian_buf, sizeof(endian_buf));
@@ -375,8 +473,8 @@ bool stlinkv2::lockFlash()
         uchar endian_buf[4];
         quint32 addr, lock;
         quint32 fcr = this->readFlashCR();
-        lock = fcr | (1 << mDevice->value("CR_LOCK"));
-        addr = mDevice->value("flash_int_reg") + mDevice->value("CR_OFFSET");
+        lock = fcr | (1 << mDevice->desc().cr_lock);
+        addr = mDevice->desc().flashCR();
         qToLittleEndian(lock, endian_buf);
         buf.append((const char *)endian_buf, sizeof(endian_buf));
         this->writeMem32(addr, buf);
@@ -421,9 +519,9 @@ bool stlinkv2::isLocked()
     bool res = false;
     const quint32 cr = this->readFlashCR();
     //    qDebug() << "Lock bit" << (*this->device)["CR_LOCK"];
-    res = cr & (1 << mDevice->value("CR_LOCK"));
+    res = cr & (1 << mDevice->desc().cr_lock);
 
-    qDebug("Flash locked: %d", res);
+    qTrace("Flash locked: %d", res);
     return res;
 }
 
@@ -433,9 +531,9 @@ quint32 stlinkv2::readFlashSR()
     quint32 res;
     QByteArray buf;
 
-    readMem32(&buf, mDevice->value("flash_int_reg") + mDevice->value("SR_OFFSET"), sizeof(quint32));
+    readMem32(&buf, mDevice->desc().flashSR(), sizeof(quint32));
     res = qFromLittleEndian<quint32>((const uchar *)buf.data());
-    qDebug() << "Flash status register: 0x" + QString::number(res, 16) << regPrint(res);
+    qTrace() << "Flash status register: 0x" + QString::number(res, 16) << regPrint(res);
     return res;
 }
 
@@ -445,9 +543,9 @@ quint32 stlinkv2::readFlashCR()
     quint32 res;
     QByteArray buf;
 
-    readMem32(&buf, mDevice->value("flash_int_reg") + mDevice->value("CR_OFFSET"), sizeof(quint32));
+    readMem32(&buf, mDevice->desc().flashCR(), sizeof(quint32));
     res = qFromLittleEndian<quint32>((const uchar *)buf.data());
-    qDebug() << "Flash control register:"
+    qTrace() << "Flash control register:"
              << "0x" + QString::number(res, 16) << regPrint(res);
     return res;
 }
@@ -466,9 +564,9 @@ quint32 stlinkv2::writeFlashCR(quint32 mask, bool value)
         val = fcr | mask; // We append bits (OR)
     else
         val = fcr & ~mask; // We remove bits (NOT AND)
-    qDebug() << "Flash control register new value: 0x" + QString::number(val, 16) << regPrint(val);
+    qTrace() << "Flash control register new value: 0x" + QString::number(val, 16) << regPrint(val);
 
-    addr = mDevice->value("flash_int_reg") + mDevice->value("CR_OFFSET");
+    addr = mDevice->desc().flashCR();
 
     qToLittleEndian(val, endian_buf);
     buf.append((const char *)endian_buf, sizeof(endian_buf));
@@ -482,7 +580,7 @@ bool stlinkv2::setFlashProgramming(bool val)
     const quint32 mask = (1 << STM32::Flash::CR_PG);
     const bool res = (this->writeFlashCR(mask, val) & mask) == mask;
 
-    qDebug("Flash programming enabled: %d", res);
+    qTrace("Flash programming enabled: %d", res);
     return res;
 }
 
@@ -545,9 +643,9 @@ bool stlinkv2::isBusy()
     bool res;
 
     const quint32 sr = this->readFlashSR();
-    res = sr & (1 << mDevice->value("SR_BSY"));
+    res = sr & (1 << mDevice->desc().sr_bsy);
 
-    qDebug("Flash busy: %d", res);
+    qTrace("Flash busy: %d", res);
     return res;
 }
 
@@ -572,7 +670,7 @@ qint32 stlinkv2::writeMem32(quint32 addr, const QByteArray &buf)
     this->sendCommand(cmdbuf); // Send the header
 
     // The actual data we are writing is on the second command
-    return mUsbEndpointOut->write(sendbuf) - remain;
+    return this->writeData(sendbuf) - remain;
 }
 
 qint32 stlinkv2::readMem32(QByteArray *buf, quint32 addr, quint16 len)
@@ -590,7 +688,7 @@ qint32 stlinkv2::readMem32(QByteArray *buf, quint32 addr, quint16 len)
     cmd_buf.append((const char *)_addr, sizeof(_addr));
     cmd_buf.append((const char *)_len, sizeof(_len)); //length the data we are requesting
     this->sendCommand(cmd_buf);
-    *buf = mUsbEndpointIn->read(len);
+    *buf = this->readResponse(len);
     return buf->size();
 }
 
@@ -603,7 +701,7 @@ qint32 stlinkv2::command(QByteArray *buf, quint8 st_cmd0, quint8 st_cmd1, quint3
 
     this->sendCommand(cmd);
     if (resp_len > 0) {
-        *buf = mUsbEndpointIn->read(resp_len);
+        *buf = this->readResponse(resp_len);
         return buf->size();
     }
     return 0;
@@ -627,7 +725,7 @@ qint32 stlinkv2::debugCommand(QByteArray *buf, quint8 st_cmd1, quint8 st_cmd2, q
     qint32 res = this->sendCommand(cmd);
 
     if (resp_len > 0) {
-        *buf = mUsbEndpointIn->read(resp_len);
+        *buf = this->readResponse(resp_len);
         return buf->size();
     }
     return res;
@@ -647,14 +745,17 @@ bool stlinkv2::writeRegister(quint32 val, quint8 index) // Not working on F4 ?
     qToLittleEndian(val, tval);
     cmd.append((const char *)tval, sizeof(tval));
     this->sendCommand(cmd);
-    tmp = mUsbEndpointIn->read(2);
+    tmp = this->readResponse(2);
 
     const quint32 tmpval = this->readRegister(index);
     if (tmpval != val) {
         qCritical("Failed to set register %d to 0x%08X, current value is 0x%08x", index, val, tmpval);
+        mRegsValid = false;
         return false;
     }
-    qDebug("Set register %d to %08X", index, val);
+    if (index < Cortex::CoreReg::COUNT)
+        mRegs[index] = val;
+    qTrace("Set register %d to %08X", index, val);
     return true;
 }
 
@@ -673,10 +774,45 @@ quint32 stlinkv2::readRegister(quint8 index)
     cmd.append(index);
     this->sendCommand(cmd);
 
-    value = mUsbEndpointIn->read(4 + offset);
+    value = this->readResponse(4 + offset);
     return qFromLittleEndian<quint32>((const uchar *)value.data() + offset);
 }
 
+bool stlinkv2::readAllRegisters()
+{
+    PrintFuncName();
+    QByteArray cmd, value;
+    quint8 offset = 0;
+    cmd.append(STLink::Cmd::DebugCommand);
+    if (mVersion.api == 1)
+        cmd.append(STLink::Cmd::Dbg::ReadAllRegs);
+    else {
+        cmd.append(STLink::Cmd::DbgV2::ReadAllRegs);
+        offset = 4;
+    }
+    this->sendCommand(cmd);
+
+    value = this->readResponse(sizeof(mRegs) + offset);
+    if (value.size() < (int)sizeof(mRegs) + offset) {
+        qCritical("Failed to read the core registers");
+        mRegsValid = false;
+        return false;
+    }
+    for (int i = 0; i < Cortex::CoreReg::COUNT; i++)
+        mRegs[i] = qFromLittleEndian<quint32>((const uchar *)value.data() + offset + (i * 4));
+    mRegsValid = true;
+    return true;
+}
+
+quint32 stlinkv2::getRegister(quint8 index)
+{
+    if (index >= Cortex::CoreReg::COUNT)
+        return this->readRegister(index);
+    if (!mRegsValid && !this->readAllRegisters())
+        return 0;
+    return mRegs[index];
+}
+
 quint32 stlinkv2::readDbgRegister(quint32 addr)
 {
     if (mVersion.api == 1)
@@ -693,7 +829,11 @@ quint32 stlinkv2::readDbgRegister(quint32 addr)
 
     this->sendCommand(cmd);
 
-    value = mUsbEndpointIn->read(8);
+    value = this->readResponse(8);
+    if (value.size() < 8 || (quint8)value.at(0) != STLink::Status::OK) {
+        qWarning("Failed to read debug register 0x%08X", addr);
+        return 0;
+    }
     return qFromLittleEndian<quint32>((const uchar *)value.data() + 4);
 }
 
@@ -713,12 +853,27 @@ bool stlinkv2::writeDbgRegister(quint32 addr, quint32 val)
     cmd.append((const char *)_val, sizeof(_val));
 
     this->sendCommand(cmd);
-    value = mUsbEndpointIn->read(2);
+    value = this->readResponse(2);
 
     return (quint8)value.at(0) == STLink::Status::OK;
 }
 
 qint32 stlinkv2::sendCommand(const QByteArray &cmd)
+{
+    if (!mStatsEnabled)
+        return this->writeCommand(cmd);
+
+    this->closeStats();
+    mStatsCmd = cmd;
+    mStatsStart = mStatsClock.nsecsElapsed();
+    const qint32 ret = this->writeCommand(cmd);
+    mStatsLast = mStatsClock.nsecsElapsed();
+    mStatsOut = qMax(ret, 0);
+    mStatsIn = 0;
+    return ret;
+}
+
+qint32 stlinkv2::writeCommand(const QByteArray &cmd)
 {
     qint32 ret = 0;
     quint8 cmd_size = 16;
@@ -736,42 +891,81 @@ qint32 stlinkv2::sendCommand(const QByteArray &cmd)
     return ret;
 }
 
+qint32 stlinkv2::writeData(const QByteArray &data)
+{
+    const qint32 ret = mUsbEndpointOut->write(data);
+    if (mStatsEnabled && !mStatsCmd.isEmpty()) {
+        mStatsLast = mStatsClock.nsecsElapsed();
+        mStatsOut += qMax(ret, 0);
+    }
+    return ret;
+}
+
+QByteArray stlinkv2::readResponse(quint32 len)
+{
+    const QByteArray buf = mUsbEndpointIn->read(len);
+    if (mStatsEnabled && !mStatsCmd.isEmpty()) {
+        mStatsLast = mStatsClock.nsecsElapsed();
+        mStatsIn += buf.size();
+    }
+    return buf;
+}
+
+void stlinkv2::closeStats()
+{
+    if (mStatsCmd.isEmpty())
+        return;
+    mStats->record(mStatsCmd, mStatsOut, mStatsIn, mStatsLast - mStatsStart);
+    mStatsCmd.clear();
+}
+
+void stlinkv2::setStatsEnabled(bool enable)
+{
+    mStatsCmd.clear();
+    mStatsEnabled = enable;
+    if (enable) {
+        mStats->clear();
+        mStatsClock.start();
+    }
+}
+
+ProbeStats *stlinkv2::stats()
+{
+    this->closeStats();
+    return mStats;
+}
+
 bool stlinkv2::sendLoader()
 {
 
-    mLoader.loadBin(mDevice->mLoaderFile);
-
-    QByteArray loader_data, check_data;
-    const char *data = mLoader.refData().constData();
-    const int size = mLoader.refData().size();
-    quint32 offset = 0, addr = mDevice->value("sram_base");
-    const int step = 128;
-    int sent;
-    int i = 0;
-    for (; i < size / step; i++) {
-
-        offset = (i * step);
-        addr = mDevice->value("sram_base") + offset;
-        loader_data = QByteArray(data + offset, step);
-        sent = this->writeMem32(addr, loader_data);
-        this->readMem32(&check_data, addr, step);
-        if (sent != step) {
-            qCritical("Loader: Only sent %d out of %d", sent, step);
-            return false;
-        }
+    if (!mLoader.loadBin(mDevice->mLoaderFile) || mLoader.refData().isEmpty()) {
+        qCritical("Loader: Could not load %s", mDevice->mLoaderFile.toStdString().c_str());
+        return false;
+    }
+    mLoaderSeq = 0; // The loader clears its mailbox at init
+
+    const QByteArray &loader_data = mLoader.refData();
+    QByteArray check_data;
+    const quint32 addr = mDevice->desc().sram_base;
+
+    // The image must stay below its parameters and leave a buffer within the device's SRAM.
+    const quint32 sram_end = addr + mDevice->desc().buffer_size;
+    if (addr + loader_data.size() > mLoader.params() || mLoader.buffer() > sram_end
+        || sram_end - mLoader.buffer() < Loader::Addr::MIN_BUFFER) {
+        qCritical("Loader: %d bytes with its buffer at 0x%08X do not fit below 0x%08X",
+                  loader_data.size(), mLoader.buffer(), sram_end);
+        return false;
+    }
+    const int step = 2048;
 
-        if (check_data != loader_data) {
-            qCritical("Loader: Upload data corrupt at 0x%08X", addr);
-            return false;
-        }
-        check_data.clear();
-    }
-    const int mod = size % step;
-    loader_data = QByteArray((data + size) - mod, mod);
-    sent = this->writeMem32(addr, loader_data);
-    this->readMem32(&check_data, addr, sent);
-    if (sent != mod) {
-        qCritical("Loader: Only sent %d out of %d", sent, mod);
+    // Upload and read back in one go, instead of a round trip per block.
+    for (int i = 0; i < loader_data.size(); i += step)
+        this->queueWriteMem32(addr + i, loader_data.mid(i, step));
+    for (int i = 0; i < loader_data.size(); i += step)
+        this->queueReadMem32(addr + i, qMin(step, loader_data.size() - i),
+                             [&check_data](const QByteArray &buf) { check_data.append(buf); });
+    if (!this->submit()) {
+        qCritical("Loader: Upload failed");
         return false;
     }
 
@@ -783,65 +977,304 @@ bool stlinkv2::sendLoader()
         return false;
     }
 
-    if (!this->writeRegister(mDevice->value("sram_base"), 15)) // PC register to sram base.
+    if (!this->writeRegister(mDevice->desc().sram_base, 15)) // PC register to sram base.
         return false;
-    qInfo("Sent loader at 0x%08X", mDevice->value("sram_base"));
+    qInfo("Sent loader at 0x%08X", mDevice->desc().sram_base);
 
     return true;
 }
 
-bool stlinkv2::setLoaderBuffer(const quint32 addr, const QByteArray &buf)
+void stlinkv2::queueCommand(const QByteArray &cmd, quint32 resp_len,
+                            std::function<void(const QByteArray &)> done, const QByteArray &data)
 {
+    STLink::Transaction t;
+    t.cmd = cmd;
+    t.data = data;
+    t.resp_len = resp_len;
+    t.done = done;
+    mQueue.enqueue(t);
+}
 
-    using namespace Loader::Addr;
-    uchar ar_tmp[4];
-    QByteArray write_buf, read_buf;
-    quint32 buffer_size = buf.size();
+void stlinkv2::queueReadMem32(quint32 addr, quint16 len, std::function<void(const QByteArray &)> done)
+{
+    QByteArray cmd;
+    len = (len + 3) & ~3;
+    cmd.append(STLink::Cmd::DebugCommand);
+    cmd.append(STLink::Cmd::Dbg::ReadMem32bit);
+    uchar _addr[4], _len[2];
+    qToLittleEndian(addr, _addr);
+    qToLittleEndian(len, _len);
+    cmd.append((const char *)_addr, sizeof(_addr));
+    cmd.append((const char *)_len, sizeof(_len));
+    this->queueCommand(cmd, len, done);
+}
 
-    qToLittleEndian(addr, ar_tmp);
-    write_buf = QByteArray((const char *)ar_tmp, 4);
-    if (this->writeMem32(PARAMS + OFFSET_DEST, write_buf) < 0) {
-        qCritical("Failed to set loader write address!");
+void stlinkv2::queueWriteMem32(quint32 addr, const QByteArray &buf)
+{
+    QByteArray cmd, data(buf);
+    if (data.size() % 4)
+        data.append(QByteArray(4 - (data.size() % 4), 0));
+    cmd.append(STLink::Cmd::DebugCommand);
+    cmd.append(STLink::Cmd::Dbg::WriteMem32bit);
+    uchar _addr[4], _len[2];
+    qToLittleEndian(addr, _addr);
+    qToLittleEndian((quint16)data.size(), _len);
+    cmd.append((const char *)_addr, sizeof(_addr));
+    cmd.append((const char *)_len, sizeof(_len));
+    this->queueCommand(cmd, 0, nullptr, data);
+}
+
+void stlinkv2::queueReadDbgRegister(quint32 addr, std::function<void(quint32)> done)
+{
+    QByteArray cmd;
+    cmd.append(STLink::Cmd::DebugCommand);
+    cmd.append(STLink::Cmd::DbgV2::ReadDbgReg);
+    uchar _addr[4];
+    qToLittleEndian(addr, _addr);
+    cmd.append((const char *)_addr, sizeof(_addr));
+    this->queueCommand(cmd, 8, [done](const QByteArray &value) {
+        if (done)
+            done(qFromLittleEndian<quint32>((const uchar *)value.constData() + 4));
+    });
+}
+
+void stlinkv2::queueWriteDbgRegister(quint32 addr, quint32 val)
+{
+    QByteArray cmd;
+    cmd.append(STLink::Cmd::DebugCommand);
+    if (mVersion.api == 1)
+        cmd.append(STLink::Cmd::Dbg::WriteDbgReg);
+    else
+        cmd.append(STLink::Cmd::DbgV2::WriteDbgReg);
+    uchar _addr[4], _val[4];
+    qToLittleEndian(addr, _addr);
+    qToLittleEndian(val, _val);
+    cmd.append((const char *)_addr, sizeof(_addr));
+    cmd.append((const char *)_val, sizeof(_val));
+    this->queueCommand(cmd, 2);
+}
+
+bool stlinkv2::submit()
+{
+    PrintFuncName() << mQueue.size() << "queued commands";
+    QQueue<STLink::Transaction> inflight;
+    QQueue<qint64> sent; // Send time of the inflight commands, for the stats
+    const int depth = mVersion.api == 1 ? 1 : mPipelineDepth;
+    bool res = true;
+
+    // Pipelined commands are accounted for here, sendCommand() would attribute responses to the wrong one.
+    this->closeStats();
+    const int cmd_size = mVersion.api == 1 ? 10 : 16;
+    auto account = [this, cmd_size](const STLink::Transaction &t, qint64 start, qint64 bytes_in) {
+        if (mStatsEnabled)
+            mStats->record(t.cmd, cmd_size + t.data.size(), bytes_in, mStatsClock.nsecsElapsed() - start);
+    };
+
+    auto complete = [this, &sent, account](const STLink::Transaction &t) {
+        const QByteArray resp = mUsbEndpointIn->read(t.resp_len);
+        account(t, sent.dequeue(), resp.size());
+        if (resp.size() < (int)t.resp_len) {
+            qCritical("Short response, got %d out of %d bytes", resp.size(), t.resp_len);
+            return false;
+        }
+        if (t.done)
+            t.done(resp);
+        return true;
+    };
+
+    while (res && !mQueue.isEmpty()) {
+        const STLink::Transaction t = mQueue.dequeue();
+        // The probe may stall on a data phase while a response is unread.
+        while (res && !t.data.isEmpty() && !inflight.isEmpty())
+            res = complete(inflight.dequeue());
+        if (!res)
+            break;
+        const qint64 start = mStatsEnabled ? mStatsClock.nsecsElapsed() : 0;
+        if (this->writeCommand(t.cmd) <= 0) {
+            res = false;
+            break;
+        }
+        if (!t.data.isEmpty() && mUsbEndpointOut->write(t.data) < t.data.size()) {
+            PrintError();
+            res = false;
+            break;
+        }
+        if (t.resp_len == 0) {
+            account(t, start, 0);
+            if (t.done)
+                t.done(QByteArray());
+            continue;
+        }
+
+        // Responses are only read once the pipeline is full, the probe works on the next command meanwhile.
+        inflight.enqueue(t);
+        sent.enqueue(start);
+        while (res && inflight.size() >= depth)
+            res = complete(inflight.dequeue());
+    }
+    while (res && !inflight.isEmpty())
+        res = complete(inflight.dequeue());
+
+    if (!res) {
+        mQueue.clear();
+        this->flush();
+    }
+    return res;
+}
+
+bool stlinkv2::setPipelineDepth(quint8 depth)
+{
+    PrintFuncName();
+    depth = qBound((quint8)1, depth, STLink::MAX_PIPELINE_DEPTH);
+    mPipelineDepth = 1;
+    if (depth == 1)
+        return true;
+    if (mVersion.api < 2) {
+        qWarning("Pipelining needs an API v2 firmware, JTAG version %u", mVersion.jtag);
         return false;
     }
 
-    qToLittleEndian(buffer_size, ar_tmp);
-    write_buf = QByteArray((const char *)ar_tmp, 4);
-    if (this->writeMem32(PARAMS + OFFSET_LEN, write_buf) < 0) {
-        qCritical("Failed to set loader write length!");
+    // Two commands back to back, both answers must come within a short deadline.
+    int answered = 0;
+    for (int i = 0; i < depth; i++)
+        this->queueCommand(QByteArray(1, STLink::Cmd::GetCurrentMode), 2, [&answered](const QByteArray &) { answered++; });
+    mPipelineDepth = depth;
+    mUsbDevice->setTimeout(STLink::PIPELINE_TEST_TIMEOUT);
+    const bool res = this->submit() && answered == depth;
+    mUsbDevice->setTimeout(USB_TIMEOUT_MSEC);
+    if (!res) {
+        mPipelineDepth = 1;
+        mQueue.clear();
+        this->flush();
+        qWarning("Probe failed the pipelining test, commands stay sequential");
         return false;
     }
+    qInfo("Pipeline depth: %u", depth);
+    return true;
+}
 
-    read_buf.clear();
-    this->readMem32(&read_buf, PARAMS + OFFSET_DEST);
-    const quint32 dest = qFromLittleEndian<quint32>((uchar *)read_buf.data());
+STLink::MemOp STLink::MemOp::read(quint32 addr, quint32 len)
+{
+    MemOp op;
+    op.is_write = false;
+    op.addr = addr;
+    op.len = len;
+    return op;
+}
 
-    read_buf.clear();
-    this->readMem32(&read_buf, PARAMS + OFFSET_LEN);
-    const quint32 len = qFromLittleEndian<quint32>((uchar *)read_buf.data());
+STLink::MemOp STLink::MemOp::write(quint32 addr, const QByteArray &data)
+{
+    MemOp op;
+    op.is_write = true;
+    op.addr = addr;
+    op.len = data.size();
+    op.data = data;
+    return op;
+}
 
-    if ((dest != addr) || (buffer_size != len)) {
-        qCritical("Failed to set loader settings!");
-        qCritical("Expected data destination and length: 0x%08X - %d", addr, buf.size());
-        qCritical("Current data destination and length: 0x%08X - %d", dest, len);
-        return false;
+STLink::MemOp STLink::MemOp::writeWord(quint32 addr, quint32 value)
+{
+    uchar ar_tmp[4];
+    qToLittleEndian(value, ar_tmp);
+    return write(addr, QByteArray((const char *)ar_tmp, 4));
+}
+
+quint32 STLink::MemOp::word(quint32 offset) const
+{
+    if (offset + 4 > (quint32)data.size())
+        return 0;
+    return qFromLittleEndian<quint32>((const uchar *)data.constData() + offset);
+}
+
+bool stlinkv2::transfer(QList<STLink::MemOp> *ops)
+{
+    PrintFuncName() << ops->size() << "memory accesses";
+    Q_CHECK_PTR(ops);
+
+    // Groups of adjacent accesses, [first, last] in ops, the data read for each.
+    struct Group {
+        int first;
+        int last;
+        QByteArray data;
+    };
+    QList<Group> groups;
+    for (int i = 0; i < ops->size(); i++) {
+        const STLink::MemOp &op = ops->at(i);
+        if (!groups.isEmpty()) {
+            const STLink::MemOp &prev = ops->at(groups.last().last);
+            // Word multiples only, padding would shift what follows.
+            if (prev.is_write == op.is_write && !(prev.len % 4) && prev.addr + prev.len == op.addr) {
+                groups.last().last = i;
+                continue;
+            }
+        }
+        groups.append(Group{i, i, QByteArray()});
     }
 
-    emit bufferPct(0);
-    int i = 0;
-    const int step = 2048;
-    for (; i < buf.size() / step; i++) {
+    const quint32 max_read = this->getMaxReadSize();
+    for (int g = 0; g < groups.size(); g++) {
+        const Group &group = groups.at(g);
+        const quint32 addr = ops->at(group.first).addr;
+        if (ops->at(group.first).is_write) {
+            QByteArray data;
+            for (int i = group.first; i <= group.last; i++)
+                data.append(ops->at(i).data);
+            for (int i = 0; i < data.size(); i += STLink::MAX_WRITE)
+                this->queueWriteMem32(addr + i, data.mid(i, STLink::MAX_WRITE));
+        } else {
+            quint32 len = 0;
+            for (int i = group.first; i <= group.last; i++)
+                len += ops->at(i).len;
+            QByteArray *data = &groups[g].data;
+            for (quint32 i = 0; i < len; i += max_read)
+                this->queueReadMem32(addr + i, qMin(max_read, len - i),
+                                     [data](const QByteArray &buf) { data->append(buf); });
+        }
+    }
+    if (!this->submit())
+        return false;
 
-        write_buf = QByteArray(buf.constData() + (i * step), step);
-        this->writeMem32(BUFFER + (i * step), write_buf);
-        emit bufferPct(((step * (i + 1)) * 100) / buf.size());
+    for (int g = 0; g < groups.size(); g++) {
+        const Group &group = groups.at(g);
+        quint32 offset = 0;
+        for (int i = group.first; i <= group.last; i++) {
+            STLink::MemOp &op = (*ops)[i];
+            if (!op.is_write)
+                op.data = group.data.mid(offset, op.len);
+            offset += op.len;
+        }
     }
-    const int mod = buf.size() % step;
-    if (mod > 0) {
-        write_buf = QByteArray(buf.constData() + buf.size() - mod, mod);
-        this->writeMem32(BUFFER + (i * step), write_buf);
+    return true;
+}
+
+bool stlinkv2::setLoaderBuffer(const quint32 addr, const QByteArray &buf)
+{
+
+    using namespace Loader::Addr;
+    using STLink::MemOp;
+    const quint32 buffer_size = buf.size();
+
+    // Parameters, their read back and the data in one batch.
+    QList<MemOp> ops;
+    ops << MemOp::writeWord(mLoader.params() + OFFSET_DEST, addr)
+        << MemOp::writeWord(mLoader.params() + OFFSET_LEN, buffer_size)
+        << MemOp::read(mLoader.params() + OFFSET_DEST, 8)
+        << MemOp::write(mLoader.buffer(), buf);
+    emit bufferPct(0);
+    if (!this->transfer(&ops)) {
+        qCritical("Failed to set loader settings!");
+        return false;
     }
     emit bufferPct(100);
+
+    const quint32 dest = ops.at(2).word(0);
+    const quint32 len = ops.at(2).word(4);
+    if ((dest != addr) || (buffer_size != len)) {
+        qCritical("Failed to set loader settings!");
+        qCritical("Expected data destination and length: 0x%08X - %d", addr, buf.size());
+        qCritical("Current data destination and length: 0x%08X - %d", dest, len);
+        return false;
+    }
     return true;
 }
 
@@ -851,7 +1284,7 @@ quint32 stlinkv2::getLoaderStatus()
     PrintFuncName();
     QByteArray read_buf;
     using namespace Loader::Addr;
-    this->readMem32(&read_buf, PARAMS + OFFSET_STATUS);
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_STATUS);
     quint32 tmp = qFromLittleEndian<quint32>((uchar *)read_buf.constData());
     //    qDebug() << this->regPrint(tmp);
     return tmp;
@@ -863,27 +1296,277 @@ quint32 stlinkv2::getLoaderPos()
     PrintFuncName();
     QByteArray read_buf;
     using namespace Loader::Addr;
-    this->readMem32(&read_buf, PARAMS + OFFSET_POS);
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_POS);
     quint32 tmp = qFromLittleEndian<quint32>((uchar *)read_buf.data());
     //    qDebug() << this->regPrint(tmp);
     return tmp;
 }
 
 void stlinkv2::getLoaderParams()
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    using STLink::MemOp;
+    QList<MemOp> ops;
+    ops << MemOp::read(mLoader.params() + OFFSET_DEST) << MemOp::read(mLoader.params() + OFFSET_LEN) << MemOp::read(mLoader.params() + OFFSET_TEST);
+    if (!this->transfer(&ops))
+        return;
+
+    qTrace("Data destination and length: 0x%08X - %d - test: 0x%08X", ops.at(0).word(), ops.at(1).word(), ops.at(2).word());
+}
+
+quint32 stlinkv2::getLoaderVersion()
 {
 
     PrintFuncName();
     QByteArray read_buf;
     using namespace Loader::Addr;
-    this->readMem32(&read_buf, PARAMS + OFFSET_DEST);
-    const quint32 dest = qFromLittleEndian<quint32>((uchar *)read_buf.data());
-    this->readMem32(&read_buf, PARAMS + OFFSET_LEN);
-    const quint32 len = qFromLittleEndian<quint32>((uchar *)read_buf.data());
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_VERSION);
+    const quint32 version = qFromLittleEndian<quint32>((uchar *)read_buf.data());
+    qDebug("Loader version: 0x%08X", version);
+    return version;
+}
+
+bool stlinkv2::loaderSupports(quint32 caps)
+{
+    const quint32 version = this->getLoaderVersion();
+    if ((version & Loader::Caps::MAGIC_MASK) != Loader::Caps::MAGIC)
+        return false;
+    return (version & caps) == caps;
+}
+
+bool stlinkv2::setLoaderCommand(quint32 cmd, quint32 len)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    using STLink::MemOp;
+
+    QList<MemOp> ops;
+    ops << MemOp::writeWord(mLoader.params() + OFFSET_LEN, len)
+        << MemOp::writeWord(mLoader.params() + OFFSET_CMD, cmd)
+        << MemOp::read(mLoader.params() + OFFSET_CMD);
+    if (!this->transfer(&ops) || ops.at(2).word() != cmd) {
+        qCritical("Failed to set loader command %d", cmd);
+        return false;
+    }
+    return true;
+}
 
-    this->readMem32(&read_buf, PARAMS + OFFSET_TEST);
-    const quint32 test = qFromLittleEndian<quint32>((uchar *)read_buf.data());
+bool stlinkv2::setLoaderSlot(quint8 slot, quint32 slot_size, quint32 addr, const QByteArray &buf, bool rle)
+{
+
+    using STLink::MemOp;
+    uchar ar_tmp[4];
+    QByteArray write_buf;
+    const quint32 base = mLoader.buffer() + (slot * slot_size);
+
+    // Pad to a full word with the erased value, the loader programs whole words.
+    QByteArray data(buf);
+    if (data.size() % 4)
+        data.append(QByteArray(4 - (data.size() % 4), (char)0xFF));
+
+    // The length stays the programmed size, raw data is sent when encoding does not pay off.
+    quint32 len = data.size();
+    if (rle && !data.isEmpty()) {
+        const QByteArray packed = Loader::rleEncode(data);
+        qTrace("Chunk at %08X: %d bytes encoded to %d", addr, data.size(), packed.size());
+        if (packed.size() < data.size()) {
+            data = packed;
+            len |= Loader::Chunk::RLE;
+        }
+    }
 
-    qDebug("Data destination and length: 0x%08X - %d - test: 0x%08X", dest, len, test);
+    if (data.size() + Loader::Chunk::HEADER_SIZE > slot_size) {
+        qCritical("Chunk of %d bytes does not fit in a %d bytes slot", data.size(), slot_size);
+        return false;
+    }
+
+    qToLittleEndian(addr, ar_tmp);
+    write_buf = QByteArray((const char *)ar_tmp, 4);
+    qToLittleEndian(len, ar_tmp);
+    write_buf.append((const char *)ar_tmp, 4);
+    write_buf.append(data);
+    // Word aligned transfers, the encoded data may end anywhere.
+    if (write_buf.size() % 4)
+        write_buf.append(QByteArray(4 - (write_buf.size() % 4), (char)0xFF));
+
+    // Chunk and ownership flag in one batch, the flag lands last.
+    QList<MemOp> ops;
+    ops << MemOp::write(base, write_buf) << this->handOverLoaderSlot(slot);
+    emit bufferPct(0);
+    if (!this->transfer(&ops)) {
+        qCritical("Failed to fill slot %d!", slot);
+        return false;
+    }
+    emit bufferPct(100);
+    return true;
+}
+
+bool stlinkv2::setLoaderSlotErased(quint8 slot, quint32 slot_size, quint32 addr, quint32 len)
+{
+
+    using STLink::MemOp;
+    const quint32 base = mLoader.buffer() + (slot * slot_size);
+
+    // Header only, the loader erases the range and programs nothing.
+    QList<MemOp> ops;
+    ops << MemOp::writeWord(base, addr)
+        << MemOp::writeWord(base + 4, len | Loader::Chunk::ERASE)
+        << this->handOverLoaderSlot(slot);
+    if (!this->transfer(&ops)) {
+        qCritical("Failed to fill slot %d!", slot);
+        return false;
+    }
+    return true;
+}
+
+STLink::MemOp stlinkv2::handOverLoaderSlot(quint8 slot)
+{
+
+    using namespace Loader::Addr;
+    // The loader clears the flag once programmed.
+    return STLink::MemOp::writeWord(mLoader.params() + OFFSET_OWNER + (slot * 4), 1);
+}
+
+bool stlinkv2::isLoaderSlotFree(quint8 slot, quint32 *status, bool *ok)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    QByteArray read_buf;
+    // Status up to the last ownership flag in one transfer.
+    const quint32 len = OFFSET_OWNER + (Loader::Chunk::SLOTS * 4) - OFFSET_STATUS;
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_STATUS, len);
+    if (ok)
+        *ok = read_buf.size() >= (int)len;
+    if (read_buf.size() < (int)len)
+        return false;
+
+    if (status)
+        *status = qFromLittleEndian<quint32>((uchar *)read_buf.constData());
+    const quint32 owner = qFromLittleEndian<quint32>((uchar *)read_buf.constData() + OFFSET_OWNER - OFFSET_STATUS + (slot * 4));
+    return owner == 0;
+}
+
+quint32 stlinkv2::postLoaderJob(quint32 cmd)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    using STLink::MemOp;
+
+    if (++mLoaderSeq == 0) // 0 is the mailbox initial value
+        mLoaderSeq = 1;
+    // The command must land before the sequence number, which triggers the job.
+    QList<MemOp> ops;
+    ops << MemOp::writeWord(mLoader.params() + OFFSET_CMD, cmd) << MemOp::writeWord(mLoader.params() + OFFSET_SEQ, mLoaderSeq);
+    if (!this->transfer(&ops)) {
+        qCritical("Failed to post loader job!");
+        return 0;
+    }
+    qTrace("Posted loader job %d, sequence %d", cmd, mLoaderSeq);
+    return mLoaderSeq;
+}
+
+bool stlinkv2::isLoaderJobDone(quint32 seq, quint32 *status, bool *ok)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    QByteArray read_buf;
+    // Status up to the acknowledge in one transfer.
+    const quint32 len = OFFSET_ACK + 4 - OFFSET_STATUS;
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_STATUS, len);
+    if (ok)
+        *ok = read_buf.size() >= (int)len;
+    if (read_buf.size() < (int)len)
+        return false;
+
+    if (status)
+        *status = qFromLittleEndian<quint32>((uchar *)read_buf.constData());
+    return qFromLittleEndian<quint32>((uchar *)read_buf.constData() + OFFSET_ACK - OFFSET_STATUS) == seq;
+}
+
+bool stlinkv2::setLoaderRange(quint32 addr, quint32 len)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    uchar ar_tmp[4];
+    QByteArray write_buf;
+
+    // Destination and length are contiguous, set both at once.
+    qToLittleEndian(addr, ar_tmp);
+    write_buf = QByteArray((const char *)ar_tmp, 4);
+    qToLittleEndian(len, ar_tmp);
+    write_buf.append((const char *)ar_tmp, 4);
+    if (this->writeMem32(mLoader.params() + OFFSET_DEST, write_buf) < 0) {
+        qCritical("Failed to set loader range!");
+        return false;
+    }
+    return true;
+}
+
+quint32 stlinkv2::getLoaderBufferSize()
+{
+
+    return mDevice->desc().sram_base + mDevice->desc().buffer_size - mLoader.buffer();
+}
+
+int stlinkv2::getLoaderTableSize()
+{
+
+    return this->getLoaderBufferSize() / 8;
+}
+
+quint32 stlinkv2::getLoaderResult()
+{
+
+    PrintFuncName();
+    QByteArray read_buf;
+    using namespace Loader::Addr;
+    this->readMem32(&read_buf, mLoader.params() + OFFSET_RESULT);
+    return qFromLittleEndian<quint32>((uchar *)read_buf.data());
+}
+
+bool stlinkv2::setLoaderTable(const QList<FlashRange> &ranges)
+{
+
+    PrintFuncName();
+    using namespace Loader::Addr;
+    using STLink::MemOp;
+
+    // Adjacent words, merged in as few transfers as the probe allows.
+    QList<MemOp> ops;
+    for (int r = 0; r < ranges.size(); r++) {
+        ops << MemOp::writeWord(mLoader.buffer() + (r * 8), ranges.at(r).first)
+            << MemOp::writeWord(mLoader.buffer() + (r * 8) + 4, ranges.at(r).second);
+    }
+    // The range count goes in LEN, the destination is unused.
+    ops << MemOp::writeWord(mLoader.params() + OFFSET_DEST, 0) << MemOp::writeWord(mLoader.params() + OFFSET_LEN, ranges.size());
+    if (!this->transfer(&ops)) {
+        qCritical("Failed to write loader table!");
+        return false;
+    }
+    return true;
+}
+
+bool stlinkv2::getLoaderHashTable(quint32 count, QList<quint32> *crcs)
+{
+
+    PrintFuncName();
+
+    QList<STLink::MemOp> ops;
+    ops << STLink::MemOp::read(mLoader.buffer(), count * 4);
+    if (!this->transfer(&ops) || ops.at(0).data.size() < (int)(count * 4))
+        return false;
+
+    crcs->clear();
+    for (quint32 i = 0; i < count; i++)
+        crcs->append(ops.at(0).word(i * 4));
+    return true;
 }
 
 QString stlinkv2::regPrint(quint32 reg) const
@@ -16,24 +16,34 @@ This file is part of QSTLink2.
 */
 #include "transferthread.h"
 #include <QPointer>
+#include <QElapsedTimer>
 
 transferThread::transferThread(QObject *parent)
     : QThread(parent)
 {
     qDebug("New Transfer Thread");
     mStop = false;
+    mDiff = false;
+    mCompress = false;
+    mBlank = false;
+    mVpp = false;
+    mResult = false;
+    mEraseStep = 0;
+    mBackgroundSize = 0;
 }
 
 void transferThread::run()
 {
-    if (mWrite) {
-        this->sendWithLoader(mFilename);
+    if (mBlank) {
+        mResult = this->blankCheck();
+    } else if (mWrite) {
+        mResult = this->sendWithLoader(mFilename);
         if (mVerify)
-            this->verify(mFilename);
+            mResult = this->verify(mFilename) && mResult;
     } else if (!mVerify) {
-        this->receive(mFilename);
+        mResult = this->receive(mFilename);
     } else {
-        this->verify(mFilename);
+        mResult = this->verify(mFilename);
     }
 }
 void transferThread::halt()
@@ -49,89 +59,166 @@ void transferThread::setParams(stlinkv2 *stlink, QString filename, bool write, b
     mFilename = filename;
     mWrite = write;
     mVerify = verify;
+    mBlank = false;
 }
 
-void transferThread::sendWithLoader(const QString &filename)
+void transferThread::setDiff(bool diff)
 {
-    qInfo("Using loader");
-    QFile loader_file(filename);
-    if (!loader_file.open(QIODevice::ReadOnly)) {
-        qCritical("Could not open the file.");
-        return;
-    }
-    emit sendLock(true);
-    mStop = false;
-    mStlink->hardResetMCU(); // We stop the MCU
-    quint32 step_size = 2048;
-    const quint32 sram_base = mStlink->mDevice->value("sram_base");
-    const quint32 buffer_size = mStlink->mDevice->value("buffer_size");
-    if (buffer_size > 0)
-        step_size = buffer_size - 2048; // Minus the loader's 2k
-    const quint32 from = mStlink->mDevice->value("flash_base");
-    const quint32 to = mStlink->mDevice->value("flash_base") + loader_file.size() - 1;
-    qInfo("Writing from %08x to %08x", from, to);
-    quint32 progress, oldprogress;
+    mDiff = diff;
+}
 
-    mStlink->resetMCU();
-    mStlink->haltMCU();
-    mStlink->flush();
+void transferThread::setCompress(bool compress)
+{
+    mCompress = compress;
+}
 
-    if (!mStlink->sendLoader()) {
-        emit sendLog("Failed to send loader!");
-        emit sendLock(false);
-        return;
+void transferThread::setBlankCheck(bool blank)
+{
+    mBlank = blank;
+}
+
+void transferThread::setVpp(bool vpp)
+{
+    mVpp = vpp;
+}
+
+bool transferThread::result() const
+{
+    return mResult;
+}
+
+bool transferThread::isErased(const QByteArray &buf, char erased)
+{
+    for (int i = 0; i < buf.size(); i++) {
+        if (buf.at(i) != erased)
+            return false;
     }
-    emit sendLog("Loader uploaded");
+    return true;
+}
 
-    mStlink->runMCU(); // The loader will stop at main()
-    while (mStlink->getStatus() == STLink::Status::RUNNING) { // Wait for the breakpoint
-        QThread::msleep(100);
-        quint32 tbkp = mStlink->readRegister(15);
-        qDebug("Waiting for breakpoint 1... at 0x0%08X", tbkp);
-        if (mStop) {
-            emit sendProgress(100);
-            emit sendLock(false);
-            return;
-        }
+QList<FlashRange> transferThread::splitRanges(const QList<FlashRange> &ranges, quint32 size)
+{
+    QList<FlashRange> chunks;
+    for (int r = 0; r < ranges.size(); r++) {
+        for (quint32 i = 0; i < ranges.at(r).second; i += size)
+            chunks.append(FlashRange(ranges.at(r).first + i, qMin(size, ranges.at(r).second - i)));
     }
+    return chunks;
+}
 
-    const quint32 bkp1 = mStlink->readRegister(15);
-    qDebug("Loop breakpoint at 0x%08X", bkp1);
+QList<FlashRange> transferThread::scheduleBackground(const QList<FlashRange> &plan, quint32 split)
+{
+    QList<FlashRange> background, foreground;
+    for (int i = 0; i < plan.size(); i++) {
+        const FlashRange &entry = plan.at(i);
+        const bool bank = entry.second & Loader::Chunk::ERASE_BANK;
+        if (entry.first < split) {
+            foreground.append(entry);
+            continue;
+        }
+        if (!bank && !background.isEmpty() && !(background.last().second & Loader::Chunk::ERASE_BANK)) {
+            FlashRange &last = background.last();
+            const quint32 last_len = last.second & ~Loader::Chunk::ERASE_BACKGROUND;
+            if (last.first + last_len == entry.first) { // Contiguous units, one range
+                last.second += entry.second;
+                continue;
+            }
+        }
+        if (background.size() < Loader::Chunk::ERASE_QUEUE)
+            background.append(FlashRange(entry.first, entry.second | Loader::Chunk::ERASE_BACKGROUND));
+        else
+            foreground.append(entry);
+    }
+    background.append(foreground);
+    return background;
+}
 
-    if (bkp1 < sram_base || bkp1 > sram_base + buffer_size) {
+bool transferThread::sendWithLoader(const QString &filename)
+{
+    qInfo("Using loader");
+    const quint32 from = mStlink->mDevice->desc().flash_base;
+    ImageSource image;
+    if (!image.open(filename, from, Loader::PROGRAM_STEP, (char)mStlink->mDevice->desc().flash_erased)) {
+        qCritical("Could not open the file.");
+        return false;
+    }
+    if (image.size() == 0 || image.start() < from) {
+        qCritical("Image 0x%08X - 0x%08X is outside the flash", image.start(), image.end());
+        emit sendLog("Image is outside the flash, aborting!");
+        return false;
+    }
+    if (image.end() > from + mStlink->mDevice->desc().flash_size * 1024)
+        qWarning("Image ends at 0x%08X, past the end of the flash", image.end());
+    emit sendLock(true);
+    mStop = false;
+    mStlink->hardResetMCU(); // We stop the MCU
+    qInfo("Writing from %08x to %08x", image.start(), image.end() - 1);
+    quint32 progress, oldprogress;
 
-        qCritical("Current PC is not in the RAM area: %08x", bkp1);
+    quint32 bkp1;
+    if (!this->startLoader(&bkp1) || !this->checkSectorLayout()) {
         emit sendProgress(100);
         emit sendLock(false);
-        return;
+        return false;
     }
+    const quint32 step_size = mStlink->getLoaderBufferSize(); // Known once the loader is sent
 
     progress = 0;
     mStlink->flush();
+    bool res = true;
     quint32 status = 0, loader_pos = 0;
-    for (int i = 0; i <= loader_file.size(); i += step_size) {
+    const bool mailbox = mStlink->loaderSupports(Loader::Caps::MAILBOX);
+    if (mailbox) {
+        qInfo("Loader supports mailbox jobs");
+        res = this->enterLoaderMailbox(bkp1);
+        if (res && mStlink->loaderSupports(Loader::Caps::PSIZE))
+            res = this->setupProgramSize();
+        if (res && mStlink->loaderSupports(Loader::Caps::CLOCK))
+            res = this->setupClock();
+        const bool stream = mStlink->loaderSupports(Loader::Caps::STREAM);
+        if (mDiff && !(stream && mStlink->loaderSupports(Loader::Caps::HASH)))
+            qWarning("Loader does not support differential flashing, writing the whole image");
+        if (res && mDiff && stream && mStlink->loaderSupports(Loader::Caps::HASH))
+            res = this->sendDiff(image);
+        else if (res && stream)
+            res = this->sendStreamed(image, image.ranges());
+        else if (res)
+            res = this->sendMailbox(image);
+        if (!res) {
+            emit sendLoaderStatus("Idle");
+            emit sendProgress(100);
+            emit sendLock(false);
+            return false;
+        }
+    }
+    const QList<FlashRange> chunks = splitRanges(image.ranges(), step_size);
+    qint64 written = 0;
+    QElapsedTimer chunk_timer;
+    for (int c = 0; !mailbox && c < chunks.size(); c++) {
 
-        if (mStop || loader_file.atEnd())
+        if (mStop) {
+            res = false;
             break;
+        }
 
-        quint32 bkp2 = mStlink->readRegister(15);
+        quint32 bkp2 = mStlink->getRegister(Cortex::CoreReg::PC);
         if (bkp1 != bkp2) {
             qCritical("PC is not at the correct address: %08x", bkp2);
             emit sendLog("PC register at the wrong address, aborting!");
             emit sendProgress(100);
             emit sendLock(false);
-            return;
+            return false;
         }
-        qDebug("+ Current PC reg at 0x%08x", bkp2);
-
-        QByteArray buf(loader_file.read(step_size));
-        qDebug("Read Bytes %u from disk", buf.size());
+        qTrace("+ Current PC reg at 0x%08x", bkp2);
 
-        const quint32 addr = mStlink->mDevice->value("flash_base") + i;
+        const quint32 addr = chunks.at(c).first;
+        const QByteArray buf(image.view(addr, chunks.at(c).second));
+        qTrace("Read Bytes %u from image", buf.size());
 
         emit sendLoaderStatus("Loading");
         if (!mStlink->setLoaderBuffer(addr, buf)) {
             emit sendStatus("Failed to set loader parameters.");
+            res = false;
             break;
         }
         // Step over breakpoint.
@@ -142,36 +229,49 @@ void transferThread::sendWithLoader(const QString &filename)
             emit sendLog("Failed to set PC register");
             emit sendProgress(100);
             emit sendLock(false);
-            return;
+            return false;
         }
         mStlink->runMCU();
+        chunk_timer.start();
 
         emit sendLoaderStatus("Writing");
 
-        while (mStlink->getStatus() == STLink::Status::RUNNING) { // Wait for the breakpoint
-
-            loader_pos = mStlink->getLoaderPos() - from;
-            qDebug("Loader position: 0x%x", loader_pos + from);
+        // Wait for the breakpoint, refreshing the progress in between.
+        qint64 halt_us;
+        while ((halt_us = mStlink->waitHalted(Loader::Timeout::PROGRESS)) == STLink::WAIT_TIMEOUT) {
+            if (mStop || chunk_timer.hasExpired(Loader::Timeout::CHUNK))
+                break;
 
-            quint32 tbkp = mStlink->readRegister(15);
-            qDebug("Waiting for breakpoint 2... at 0x0%08X", tbkp);
+            loader_pos = mStlink->getLoaderPos() - addr;
+            qTrace("Loader position: 0x%x", loader_pos + addr);
 
             oldprogress = progress;
-            progress = (loader_pos * 100) / loader_file.size();
+            progress = ((written + loader_pos) * 100) / image.size();
             if (progress > oldprogress && progress <= 100) { // Push only if number has increased
                 emit sendProgress(progress);
                 qInfo("Progress: %u%%", progress);
             }
 
-            emit sendStatus(QString().asprintf("Transferred %u/%lldKB", i / 1024, loader_file.size() / 1024));
-            QThread::msleep(30);
-            if (mStop)
-                break;
+            emit sendStatus(QString().asprintf("Transferred %lld/%lldKB", written / 1024, image.size() / 1024));
+        }
+        if (halt_us < 0) {
+            if (halt_us == STLink::WAIT_ERROR) {
+                qCritical("Failed to read the core status while the loader runs");
+                emit sendLog("Probe communication failed, aborting!");
+            } else if (!mStop) {
+                qCritical("Loader didn't reach its breakpoint within %ums", Loader::Timeout::CHUNK);
+                emit sendLog("Loader timed out, aborting!");
+            }
+            res = false;
+            break;
         }
+        qDebug("Chunk written in %lldms", chunk_timer.elapsed());
+        written += buf.size();
 
         status = mStlink->getLoaderStatus();
         if (status & Loader::Masks::ERR) {
             qCritical("Loader reported an error!");
+            res = false;
             break;
         }
 
@@ -181,9 +281,9 @@ void transferThread::sendWithLoader(const QString &filename)
         }
     }
     emit sendLoaderStatus("Idle");
-    loader_file.close();
+    image.close();
 
-    qDebug("Current PC reg %08x", mStlink->readRegister(15));
+    qDebug("Current PC reg %08x", mStlink->getRegister(Cortex::CoreReg::PC));
 
     emit sendProgress(100);
     emit sendStatus("Transfer done");
@@ -195,37 +295,528 @@ void transferThread::sendWithLoader(const QString &filename)
     mStlink->runMCU();
 
     emit sendLock(false);
+    return res && !mStop;
+}
+
+bool transferThread::startLoader(quint32 *bkp1)
+{
+    const quint32 sram_base = mStlink->mDevice->desc().sram_base;
+    const quint32 buffer_size = mStlink->mDevice->desc().buffer_size;
+
+    mStlink->resetMCU();
+    mStlink->haltMCU();
+    mStlink->flush();
+    mBackgroundSize = 0;
+
+    if (!mStlink->sendLoader()) {
+        emit sendLog("Failed to send loader!");
+        return false;
+    }
+    emit sendLog("Loader uploaded");
+
+    mStlink->runMCU(); // The loader will stop at main()
+    const qint64 halt_us = mStlink->waitHalted(Loader::Timeout::STARTUP);
+    if (halt_us == STLink::WAIT_ERROR) {
+        emit sendLog("Failed to read the core status after starting the loader!");
+        return false;
+    }
+    if (halt_us < 0) {
+        emit sendLog("Loader didn't reach its first breakpoint!");
+        return false;
+    }
+    qDebug("Loader started in %lldus", halt_us);
+
+    *bkp1 = mStlink->getRegister(Cortex::CoreReg::PC);
+    qDebug("Loop breakpoint at 0x%08X", *bkp1);
+
+    if (*bkp1 < sram_base || *bkp1 > sram_base + buffer_size) {
+        qCritical("Current PC is not in the RAM area: %08x", *bkp1);
+        return false;
+    }
+
+    // Only valid until the first job, which reuses RESULT.
+    mEraseStep = 0;
+    if (mStlink->loaderSupports(Loader::Caps::GEOMETRY)) {
+        mEraseStep = mStlink->getLoaderResult();
+        qDebug("Loader erase step: 0x%X", mEraseStep);
+    }
+    return true;
+}
+
+bool transferThread::enterLoaderMailbox(quint32 bkp1)
+{
+    if (!mStlink->setLoaderCommand(Loader::Cmd::MAILBOX, 0)) {
+        emit sendLog("Failed to set loader command!");
+        return false;
+    }
+
+    // Step over breakpoint for the last time, jobs are then posted without halting the core.
+    if (mStlink->getStatus() == STLink::Status::RUNNING)
+        mStlink->haltMCU();
+    if (!mStlink->writeRegister(bkp1 + 2, 15)) {
+        emit sendLog("Failed to set PC register");
+        return false;
+    }
+    mStlink->runMCU();
+    return true;
 }
 
-void transferThread::receive(const QString &filename)
+bool transferThread::waitLoaderJob(quint32 seq, quint32 timeout)
 {
-    QFile file(filename);
-    QByteArray buffer;
+    quint32 status = 0;
+    bool ok = true;
+    QElapsedTimer timer;
+    timer.start();
+    while (!mStlink->isLoaderJobDone(seq, &status, &ok)) {
+        if (mStop)
+            return false;
+        if (!ok) {
+            qCritical("Failed to read the loader status");
+            emit sendLog("Probe communication failed, aborting!");
+            return false;
+        }
+        if (timer.hasExpired(timeout)) {
+            qCritical("Loader job %u didn't complete within %ums", seq, timeout);
+            emit sendLog("Loader timed out, aborting!");
+            return false;
+        }
+        QThread::msleep(1);
+    }
+    if (status & Loader::Masks::ERR) {
+        qCritical("Loader reported an error!");
+        emit sendLog("Loader reported an error, aborting!");
+        return false;
+    }
+    if (status & Loader::Masks::DEL) {
+        emit sendLoaderStatus("Erased");
+        qInfo("Page(s) deleted");
+    }
+    return true;
+}
+
+quint32 transferThread::jobTimeout(qint64 bytes, quint32 per_kb) const
+{
+    const qint64 kb = (bytes + 1023) / 1024;
+    const qint64 background_kb = (mBackgroundSize + 1023) / 1024;
+    return Loader::Timeout::CHUNK + (kb * per_kb) + (background_kb * Loader::Timeout::WRITE_KB);
+}
+
+bool transferThread::sendMailbox(const ImageSource &image)
+{
+    const quint32 step_size = mStlink->getLoaderBufferSize();
+    quint32 progress = 0, oldprogress;
+
+    const bool skip = mStlink->loaderSupports(Loader::Caps::SKIP);
+    const char erased = (char)mStlink->mDevice->desc().flash_erased;
+
+    const QList<FlashRange> chunks = splitRanges(image.ranges(), step_size);
+    qint64 sent = 0;
+    for (int c = 0; c < chunks.size(); c++) {
+        if (mStop)
+            return false;
+
+        const QByteArray buf(image.view(chunks.at(c).first, chunks.at(c).second));
+        qTrace("Read Bytes %u from image", buf.size());
+
+        emit sendLoaderStatus("Loading");
+        if (skip && isErased(buf, erased)) { // Nothing to upload, the loader only erases
+            if (!mStlink->setLoaderRange(chunks.at(c).first, buf.size() | Loader::Chunk::ERASE))
+                return false;
+        } else if (!mStlink->setLoaderBuffer(chunks.at(c).first, buf)) {
+            emit sendStatus("Failed to set loader parameters.");
+            return false;
+        }
+
+        emit sendLoaderStatus("Writing");
+        const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::PROGRAM);
+        if (!seq || !this->waitLoaderJob(seq, this->jobTimeout(buf.size(), Loader::Timeout::WRITE_KB)))
+            return false;
+        sent += buf.size();
+
+        oldprogress = progress;
+        progress = (sent * 100) / image.size();
+        if (progress > oldprogress && progress <= 100) { // Push only if number has increased
+            emit sendProgress(progress);
+            qInfo("Progress: %u%%", progress);
+        }
+        emit sendStatus(QString().asprintf("Transferred %lld/%lldKB", sent / 1024, image.size() / 1024));
+    }
+    return true;
+}
+
+bool transferThread::sendDiff(const ImageSource &image)
+{
+    const char erased = (char)mStlink->mDevice->desc().flash_erased;
+    const QList<FlashRange> ranges = image.ranges();
+    const QList<FlashRange> units = mStlink->mDevice->eraseUnits(ranges);
+    if (units.isEmpty()) {
+        qWarning("No flash geometry for this device, writing the whole image");
+        return this->sendStreamed(image, ranges);
+    }
+    if (!this->eraseGeometryMatches()) {
+        qWarning("Loader erase units don't match the device's, writing the whole image");
+        return this->sendStreamed(image, ranges);
+    }
+
+    const int batch_size = mStlink->getLoaderTableSize();
+    QList<FlashRange> dirty;
+    emit sendLoaderStatus("Hashing");
+    for (int i = 0; i < units.size(); i += batch_size) {
+        if (mStop)
+            return false;
+
+        const QList<FlashRange> batch = units.mid(i, batch_size);
+        QList<quint32> crcs;
+        if (!mStlink->setLoaderTable(batch))
+            return false;
+        qint64 batch_bytes = 0;
+        for (int u = 0; u < batch.size(); u++)
+            batch_bytes += batch.at(u).second;
+        const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::HASH);
+        if (!seq || !this->waitLoaderJob(seq, this->jobTimeout(batch_bytes, Loader::Timeout::READ_KB))
+            || !mStlink->getLoaderHashTable(batch.size(), &crcs))
+            return false;
+
+        for (int u = 0; u < batch.size(); u++) {
+            // Erasing a unit clears everything the image does not cover, compare against that.
+            const quint32 unit_start = batch.at(u).first;
+            const quint32 unit_end = unit_start + batch.at(u).second;
+            if (crcs.at(u) == Loader::crc32(image.extract(unit_start, batch.at(u).second, erased)))
+                continue;
+
+            // Only the image parts are sent, merging neighbours into one range.
+            for (int r = 0; r < ranges.size(); r++) {
+                const quint32 start = qMax(unit_start, ranges.at(r).first);
+                const quint32 end = qMin(unit_end, ranges.at(r).first + ranges.at(r).second);
+                if (start >= end)
+                    continue;
+                if (!dirty.isEmpty() && dirty.last().first + dirty.last().second == start)
+                    dirty.last().second += end - start;
+                else
+                    dirty.append(FlashRange(start, end - start));
+            }
+        }
+    }
+
+    quint32 dirty_size = 0;
+    for (int i = 0; i < dirty.size(); i++)
+        dirty_size += dirty.at(i).second;
+    qInfo("%d erase units checked, %u bytes to write", units.size(), dirty_size);
+    emit sendLog(QString().asprintf("Differential flashing: %u/%lld bytes to write", dirty_size, image.size()));
+    if (dirty.isEmpty())
+        return true;
+
+    return this->sendStreamed(image, dirty);
+}
+
+bool transferThread::setupProgramSize()
+{
+    const double voltage = mStlink->getTargetVoltage();
+    quint32 size = 4; // Unknown voltage, what the loader always did
+    if (voltage >= 2.7)
+        size = mVpp ? 8 : 4;
+    else if (voltage >= 2.1)
+        size = 2;
+    else if (voltage >= 1.8)
+        size = 1;
+    else if (voltage > 0) {
+        qWarning("Target voltage %.2fV is below 1.8V, keeping the loader's program size", voltage);
+        return true;
+    }
+    if (mVpp && size != 8)
+        qWarning("VPP needs a 2.7-3.6V supply, not used");
+
+    if (!mStlink->setLoaderRange(0, size))
+        return false;
+    const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::PSIZE);
+    if (!seq || !this->waitLoaderJob(seq, this->jobTimeout(0, 0)))
+        return false;
+    qInfo("Programming x%u", mStlink->getLoaderResult() * 8);
+    return true;
+}
+
+bool transferThread::setupClock()
+{
+    const quint32 profile = mStlink->mDevice->desc().loader_clock;
+    if (profile == Loader::Clock::RESET)
+        return true;
+
+    if (!mStlink->setLoaderRange(0, profile))
+        return false;
+    const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::CLOCK);
+    if (!seq)
+        return false;
+    // Not waitLoaderJob(), a profile the loader refuses is not fatal.
+    quint32 status = 0;
+    bool ok = true;
+    QElapsedTimer timer;
+    timer.start();
+    while (!mStlink->isLoaderJobDone(seq, &status, &ok)) {
+        if (mStop)
+            return false;
+        if (!ok || timer.hasExpired(Loader::Timeout::STARTUP)) {
+            qCritical("Loader didn't answer the clock profile request");
+            emit sendLog("Loader timed out, aborting!");
+            return false;
+        }
+        QThread::msleep(1);
+    }
+    if (status & Loader::Masks::ERR)
+        qWarning("Loader clock profile %u not applied, running at the reset clock", profile);
+    else
+        qInfo("Loader clock profile %u", profile);
+    return true;
+}
+
+bool transferThread::sendErasePlan(const QList<FlashRange> &ranges)
+{
+    QList<FlashRange> plan = mStlink->mDevice->erasePlan(ranges);
+    if (plan.isEmpty()) // No flash geometry, the loader erases as it programs
+        return true;
+    if (!this->eraseGeometryMatches()) {
+        qWarning("Loader erase units don't match the device's, erasing while programming");
+        return true;
+    }
+
+    const QList<FlashRange> banks = mStlink->mDevice->banks();
+    const bool sectors = !mStlink->mDevice->mSectors.isEmpty();
+    quint32 erase_size = 0;
+    int bank_count = 0;
+    for (int i = 0; i < plan.size(); i++) {
+        erase_size += plan.at(i).second;
+        if (banks.contains(plan.at(i))) {
+            plan[i].second |= Loader::Chunk::ERASE_BANK;
+            bank_count++;
+        } else if (sectors) { // The loader erases the sector the host numbered
+            const int snb = mStlink->mDevice->sectorNumber(plan.at(i).first);
+            if (snb < 0 || (quint32)snb > Loader::Chunk::ERASE_SNB_MAX) {
+                qCritical("No sector number for 0x%08X", plan.at(i).first);
+                emit sendLog("Erase plan failed, aborting!");
+                return false;
+            }
+            plan[i].second |= Loader::Chunk::ERASE_SECTOR | ((quint32)snb << Loader::Chunk::ERASE_SNB_SHIFT);
+        }
+    }
+    qInfo("Erase plan: %d unit(s) including %d bank(s), %uKB", plan.size(), bank_count, erase_size / 1024);
+
+    // The other banks erase while the first one is erased and programmed.
+    if (banks.size() > 1 && mStlink->loaderSupports(Loader::Caps::BACKGROUND)) {
+        plan = scheduleBackground(plan, banks.first().first + banks.first().second);
+        qInfo("Erasing past 0x%08X in the background", banks.first().first + banks.first().second);
+    }
+
+    const int batch_size = mStlink->getLoaderTableSize();
+    emit sendLoaderStatus("Erasing");
+    for (int i = 0; i < plan.size(); i += batch_size) {
+        if (mStop)
+            return false;
+
+        const QList<FlashRange> batch = plan.mid(i, batch_size);
+        qint64 batch_bytes = 0;
+        for (int u = 0; u < batch.size(); u++) {
+            if (batch.at(u).second & Loader::Chunk::ERASE_BACKGROUND)
+                mBackgroundSize += batch.at(u).second & Loader::Chunk::ERASE_LEN_MASK;
+            else
+                batch_bytes += batch.at(u).second & Loader::Chunk::ERASE_LEN_MASK;
+        }
+        if (!mStlink->setLoaderTable(batch))
+            return false;
+        const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::ERASE);
+        if (!seq || !this->waitLoaderJob(seq, this->jobTimeout(batch_bytes, Loader::Timeout::WRITE_KB)))
+            return false;
+    }
+    return true;
+}
+
+bool transferThread::eraseGeometryMatches()
+{
+    if (!mStlink->loaderSupports(Loader::Caps::GEOMETRY))
+        return false;
+
+    const quint32 page_size = mStlink->mDevice->desc().flash_page_size;
+    if (!mStlink->mDevice->mSectors.isEmpty())
+        return mEraseStep == 0 && mStlink->loaderSupports(Loader::Caps::SECTORS);
+    return mEraseStep > 0 && page_size > 0 && page_size % mEraseStep == 0;
+}
+
+bool transferThread::checkSectorLayout()
+{
+    const QList<quint32> &sectors = mStlink->mDevice->mSectors;
+    const DeviceDescriptor &desc = mStlink->mDevice->desc();
+    if (sectors.isEmpty())
+        return true;
+
+    // The 1MB parts of dual bank families can split their flash in two banks, with another layout.
+    if (desc.flash_bank_size && desc.flash_size * 1024 <= desc.flash_bank_size) {
+        QByteArray buf;
+        if (mStlink->readMem32(&buf, desc.flash_int_reg + STM32::Flash::F4_OPTCR_OFFSET) < 4) {
+            qCritical("Failed to read the flash option control register");
+            return false;
+        }
+        if (qFromLittleEndian<quint32>((uchar *)buf.data()) & STM32::Flash::F4_OPTCR_DB1M) {
+            qCritical("Dual bank mode (DB1M) is set, its sector layout is not supported");
+            emit sendLog("Dual bank mode (DB1M) is not supported, aborting!");
+            return false;
+        }
+    }
+
+    if (mStlink->loaderSupports(Loader::Caps::ERASE | Loader::Caps::SECTORS))
+        return true; // Every sector is numbered in the erase plan
+
+    // Older loaders erase from a built-in map: 4x16KB, 64KB then 128KB sectors in each 1MB bank.
+    static const quint32 builtin[] = { 0x4000, 0x4000, 0x4000, 0x4000, 0x10000, 0x20000 };
+    for (int i = 0; i < sectors.size(); i++) {
+        if (sectors.at(i) != builtin[qMin(i % 12, 5)]) {
+            qCritical("The loader doesn't know the sector layout of %s", mStlink->mDevice->mType.toStdString().c_str());
+            emit sendLog("The loader can't erase this device's sectors, aborting!");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool transferThread::sendStreamed(const ImageSource &image, const QList<FlashRange> &ranges)
+{
+    // Two word aligned slots in the buffer area left by the loader
+    const quint32 slot_size = (mStlink->getLoaderBufferSize() / Loader::Chunk::SLOTS) & ~3;
+    const quint32 chunk_size = slot_size - Loader::Chunk::HEADER_SIZE;
+    quint32 progress = 0, oldprogress, status = 0;
+    quint8 slot = 0;
+    const bool rle = mCompress && mStlink->loaderSupports(Loader::Caps::RLE);
+    if (mCompress && !rle)
+        qWarning("Loader does not support compressed chunks, sending raw data");
+    const bool skip = mStlink->loaderSupports(Loader::Caps::SKIP);
+    const char erased = (char)mStlink->mDevice->desc().flash_erased;
+    qint64 skipped = 0;
+
+    if (mStlink->loaderSupports(Loader::Caps::ERASE) && !this->sendErasePlan(ranges))
+        return false;
+
+    // The stream runs as a single mailbox job, the slot size goes in LEN.
+    if (!mStlink->setLoaderCommand(Loader::Cmd::STREAM, slot_size)) {
+        emit sendLog("Failed to set loader command!");
+        return false;
+    }
+    const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::STREAM);
+    if (!seq)
+        return false;
+
+    const QList<FlashRange> chunks = splitRanges(ranges, chunk_size);
+    // A slot frees up once the loader is done with both slots at most.
+    const quint32 slot_timeout = this->jobTimeout(slot_size * Loader::Chunk::SLOTS, Loader::Timeout::WRITE_KB);
+    QElapsedTimer slot_timer;
+    qint64 total = 0;
+    for (int i = 0; i < ranges.size(); i++)
+        total += ranges.at(i).second;
+
+    qint64 sent = 0;
+    for (int c = 0; c <= chunks.size(); c++) {
+
+        // Wait until the loader has programmed what was previously in this slot.
+        bool ok = true;
+        slot_timer.start();
+        while (!mStlink->isLoaderSlotFree(slot, &status, &ok)) {
+            if (!ok) {
+                qCritical("Failed to read the loader status");
+                emit sendLog("Probe communication failed, aborting!");
+                return false;
+            }
+            if (status & Loader::Masks::ERR) {
+                qCritical("Loader reported an error!");
+                emit sendLog("Loader reported an error, aborting!");
+                return false;
+            }
+            if (mStop)
+                return false;
+            if (slot_timer.hasExpired(slot_timeout)) {
+                qCritical("Loader didn't release slot %d within %ums", slot, slot_timeout);
+                emit sendLog("Loader timed out, aborting!");
+                return false;
+            }
+            QThread::msleep(1);
+        }
+        if (status & Loader::Masks::DEL)
+            emit sendLoaderStatus("Erased");
+
+        // An empty chunk ends the stream once all the data has been handed over.
+        QByteArray buf;
+        quint32 addr = 0;
+        if (!mStop && c < chunks.size()) {
+            addr = chunks.at(c).first;
+            buf = image.view(addr, chunks.at(c).second);
+        } else {
+            c = chunks.size();
+        }
+        qTrace("Read Bytes %u from image", buf.size());
+
+        emit sendLoaderStatus("Streaming");
+        if (skip && !buf.isEmpty() && isErased(buf, erased)) { // Nothing to upload, the loader only erases
+            if (!mStlink->setLoaderSlotErased(slot, slot_size, addr, buf.size()))
+                return false;
+            skipped += buf.size();
+        } else if (!mStlink->setLoaderSlot(slot, slot_size, addr, buf, rle)) {
+            emit sendStatus("Failed to set loader parameters.");
+            return false;
+        }
+        sent += buf.size();
+        slot = (slot + 1) % Loader::Chunk::SLOTS;
+
+        oldprogress = progress;
+        progress = total > 0 ? (sent * 100) / total : 100;
+        if (progress > oldprogress && progress <= 100) { // Push only if number has increased
+            emit sendProgress(progress);
+            qInfo("Progress: %u%%", progress);
+        }
+        emit sendStatus(QString().asprintf("Transferred %lld/%lldKB", sent / 1024, total / 1024));
+    }
+
+    if (skipped > 0)
+        qInfo("%lld erased bytes skipped", skipped);
+
+    // The job completes once the last chunk is programmed.
+    return this->waitLoaderJob(seq, slot_timeout) && !mStop;
+}
+
+bool transferThread::receive(const QString &filename)
+{
+    const quint32 from = mStlink->mDevice->desc().flash_base;
+    const quint32 flash_size = mStlink->mDevice->desc().flash_size * 1024;
+    const quint32 to = from + flash_size;
+    ImageSink image;
     QString tmpStr;
-    if (!file.open(QIODevice::ReadWrite)) {
+    if (!image.open(filename, flash_size)) {
         qCritical("Could not save the file.");
-        return;
+        return false;
     }
     emit sendLock(true);
     mStop = false;
     mStlink->hardResetMCU(); // We stop the MCU
-    const quint32 buf_size = 2048;
-    const quint32 from = mStlink->mDevice->value("flash_base");
-    const quint32 to = mStlink->mDevice->value("flash_base") + from;
-    const quint32 flash_size = mStlink->mDevice->value("flash_size") * 1024;
-    qInfo("Reading from %08x to %08x", from, to);
+    const quint32 read_size = mStlink->getMaxReadSize();
+    const quint32 buf_size = read_size * 8; // Reads queued between progress updates
+    qInfo("Reading from %08x to %08x, %u bytes per read", from, to, read_size);
     quint32 addr, progress, oldprogress;
 
     progress = 0;
     mStlink->flush();
+    bool res = true;
     for (quint32 i = 0; i < flash_size; i += buf_size) {
-        if (mStop)
+        if (mStop) {
+            res = false;
             break;
-        buffer.clear();
-        addr = mStlink->mDevice->value("flash_base") + i;
-        if (mStlink->readMem32(&buffer, addr, buf_size) < 0)
+        }
+        // The next read is already in flight while a block is written to disk.
+        for (quint32 b = i; b < qMin(i + buf_size, flash_size); b += read_size) {
+            addr = from + b;
+            mStlink->queueReadMem32(addr, qMin(read_size, flash_size - b), [&image, b](const QByteArray &buffer) {
+                if (!image.write(b, buffer))
+                    qCritical("Failed to write %d bytes at offset 0x%x", buffer.size(), b);
+            });
+        }
+        if (!mStlink->submit()) {
+            emit sendStatus("Read failed at 0x" + QString::number(from + i, 16));
+            res = false;
             break;
-        qDebug("Wrote %lld Bytes to disk", file.write(buffer));
+        }
         oldprogress = progress;
         progress = (i * 100) / flash_size;
         if (progress > oldprogress) { // Push only if number has increased
@@ -234,54 +825,204 @@ void transferThread::receive(const QString &filename)
         }
         emit sendStatus(tmpStr.asprintf("Transferred %u/%uKB", i / 1024, flash_size / 1024));
     }
-    file.close();
+    image.close();
     emit sendProgress(100);
     emit sendStatus("Transfer done");
     qInfo("Transfer done");
     mStlink->runMCU();
     emit sendLock(false);
+    return res;
 }
 
-void transferThread::verify(const QString &filename, quint32 address)
+bool transferThread::verify(const QString &filename, quint32 address)
 {
-    QFile file(filename);
-    QString tmp_str;
-    QByteArray usb_buffer, file_buffer;
-    if (!file.open(QIODevice::ReadOnly)) {
+    quint32 base;
+    if (address > 0)
+        base = address;
+    else
+        base = mStlink->mDevice->desc().flash_base;
+    ImageSource image;
+    // Padded as written, the loader CRC and the probe reads need whole words.
+    if (!image.open(filename, base, Loader::PROGRAM_STEP, (char)mStlink->mDevice->desc().flash_erased)) {
         qCritical("Could not open the file.");
-        return;
+        return false;
     }
     emit sendLock(true);
     mStop = false;
     mStlink->hardResetMCU(); // We stop the MCU
-    quint32 buf_size = 2048;
-    quint32 base;
-    if (address > 0)
-        base = address;
-    else
-        base = mStlink->mDevice->value("flash_base");
-    quint32 from = base;
-    quint32 to = base + file.size();
-    qInfo("Reading from %08x to %08x", from, to);
-    quint32 addr, progress, oldprogress;
+    qInfo("Reading from %08x to %08x", image.start(), image.end());
+
+    mStlink->flush();
+    bool res = true;
+    quint32 bkp1;
+    const QList<FlashRange> ranges = image.ranges();
+    const bool loader_started = this->startLoader(&bkp1);
+    if (loader_started && mStlink->loaderSupports(Loader::Caps::MAILBOX | Loader::Caps::CRC)
+        && this->enterLoaderMailbox(bkp1)) {
+        qInfo("Verifying with loader CRC");
+        res = this->verifyCrc(image);
+    } else {
+        qint64 done = 0;
+        for (int r = 0; res && r < ranges.size(); r++) {
+            res = this->compareRange(image, ranges.at(r).first, ranges.at(r).second, done);
+            done += ranges.at(r).second;
+        }
+    }
+    image.close();
+    emit sendProgress(100);
+    if (res) {
+        emit sendStatus("Verification OK");
+        qInfo("Verification OK");
+    }
+    if (loader_started) { // Get rid of the loader
+        mStlink->hardResetMCU();
+        mStlink->resetMCU();
+    }
+    mStlink->runMCU();
+    emit sendLock(false);
+    return res;
+}
+
+bool transferThread::blankCheck()
+{
+    const quint32 from = mStlink->mDevice->desc().flash_base;
+    const quint32 flash_size = mStlink->mDevice->desc().flash_size * 1024;
+    const quint32 to = from + flash_size;
+    const char erased = (char)mStlink->mDevice->desc().flash_erased;
+    emit sendLock(true);
+    mStop = false;
+    mStlink->hardResetMCU(); // We stop the MCU
+    qInfo("Blank checking from %08x to %08x", from, to);
 
-    progress = 0;
     mStlink->flush();
-    for (quint32 i = 0; i < file.size(); i += buf_size) {
+    bool res = true;
+    quint32 first = to;
+    quint32 bkp1;
+    const bool loader_started = this->startLoader(&bkp1);
+    if (loader_started && mStlink->loaderSupports(Loader::Caps::MAILBOX | Loader::Caps::BLANK)
+        && this->enterLoaderMailbox(bkp1)) {
+        // A single job, the loader scans the flash word by word.
+        const quint32 seq = mStlink->setLoaderRange(from, flash_size) ? mStlink->postLoaderJob(Loader::Cmd::BLANK) : 0;
+        res = seq && this->waitLoaderJob(seq, this->jobTimeout(flash_size, Loader::Timeout::READ_KB));
+        if (res)
+            first = mStlink->getLoaderResult();
+    } else {
+        qInfo("Blank checking by reading back the flash");
+        const quint32 read_size = mStlink->getMaxReadSize();
+        QByteArray buf;
+        quint32 progress = 0, oldprogress;
+        for (quint32 i = 0; res && first == to && i < flash_size; i += read_size) {
+            if (mStop) {
+                res = false;
+                break;
+            }
+            buf.clear();
+            const qint32 len = qMin(read_size, flash_size - i);
+            if (mStlink->readMem32(&buf, from + i, len) != len) {
+                qCritical("Read failed at %08X", from + i);
+                emit sendStatus("Read failed at 0x" + QString::number(from + i, 16));
+                res = false;
+                break;
+            }
+            for (int b = 0; b < buf.size(); b++) {
+                if (buf.at(b) != erased) {
+                    first = from + i + b;
+                    break;
+                }
+            }
+            oldprogress = progress;
+            progress = (i * 100) / flash_size;
+            if (progress > oldprogress) { // Push only if number has increased
+                emit sendProgress(progress);
+                qInfo("Progress: %u%%", progress);
+            }
+        }
+    }
+    emit sendProgress(100);
+    if (res && first >= to) {
+        emit sendStatus("Flash is blank");
+        emit sendLog("Flash is blank");
+    } else if (res) {
+        emit sendStatus("Flash is not blank");
+        emit sendLog(QString().asprintf("Flash is not blank, data at 0x%08X", first));
+    }
+    if (loader_started) { // Get rid of the loader
+        mStlink->hardResetMCU();
+        mStlink->resetMCU();
+    }
+    mStlink->runMCU();
+    emit sendLock(false);
+    return res && first >= to;
+}
+
+bool transferThread::verifyCrc(const ImageSource &image)
+{
+    const quint32 block_size = 16 * 1024; // Read back granularity on mismatch
+    QString tmp_str;
+    QByteArray file_buffer;
+    quint32 progress = 0, oldprogress;
+
+    const QList<FlashRange> blocks = splitRanges(image.ranges(), block_size);
+    qint64 done = 0;
+    for (int i = 0; i < blocks.size(); i++) {
         if (mStop)
-            break;
+            return false;
+
+        const quint32 addr = blocks.at(i).first;
+        file_buffer = image.view(addr, blocks.at(i).second);
+        if (!mStlink->setLoaderRange(addr, file_buffer.size()))
+            return false;
+        const quint32 seq = mStlink->postLoaderJob(Loader::Cmd::CRC);
+        if (!seq || !this->waitLoaderJob(seq, this->jobTimeout(file_buffer.size(), Loader::Timeout::READ_KB)))
+            return false;
+
+        const quint32 target_crc = mStlink->getLoaderResult();
+        const quint32 file_crc = Loader::crc32(file_buffer);
+        if (target_crc != file_crc) {
+            qWarning("CRC mismatch at %08X: expecting %08X, got %08X", addr, file_crc, target_crc);
+            if (!this->compareRange(image, addr, file_buffer.size(), done))
+                return false;
+        }
+        done += file_buffer.size();
+
+        oldprogress = progress;
+        progress = (done * 100) / image.size();
+        if (progress > oldprogress) { // Push only if number has increased
+            emit sendProgress(progress);
+            qInfo("Progress: %u%%", progress);
+        }
+        emit sendStatus(tmp_str.asprintf("Verified %lld/%lldKB", done / 1024, image.size() / 1024));
+    }
+    return true;
+}
+
+bool transferThread::compareRange(const ImageSource &image, quint32 addr, quint32 len, qint64 done)
+{
+    const quint32 buf_size = 2048;
+    QString tmp_str;
+    QByteArray usb_buffer, file_buffer;
+    quint32 progress, oldprogress;
+
+    progress = image.size() > 0 ? (done * 100) / image.size() : 0;
+    for (quint32 i = 0; i < len; i += buf_size) {
+        if (mStop)
+            return false;
 
-        file_buffer = file.read(buf_size);
-        addr = base + i;
+        file_buffer = image.view(addr + i, qMin(buf_size, len - i));
         usb_buffer.clear();
-        if (mStlink->readMem32(&usb_buffer, addr, file_buffer.size()) < 0) // Read same amount of data as from file.
-            break;
+        // Whole words are read, only the bytes from the file are compared.
+        const qint32 read_len = (file_buffer.size() + 3) & ~3;
+        if (mStlink->readMem32(&usb_buffer, addr + i, read_len) != read_len) {
+            qCritical("Read failed at %08X", addr + i);
+            emit sendStatus("Read failed at 0x" + QString::number(addr + i, 16));
+            return false;
+        }
+        usb_buffer.truncate(file_buffer.size());
 
         if (usb_buffer != file_buffer) {
 
-            file.close();
             emit sendProgress(100);
-            emit sendStatus("Verification failed at 0x" + QString::number(addr, 16));
+            emit sendStatus("Verification failed at 0x" + QString::number(addr + i, 16));
 
             QString stmp, sbuf;
             for (int b = 0; b < file_buffer.size(); b++) {
@@ -289,23 +1030,16 @@ void transferThread::verify(const QString &filename, quint32 address)
                 sbuf.append(tmp_str.asprintf("%02X ", (uchar)usb_buffer.at(b)));
             }
             qCritical("Verification failed at %08X \r\n Expecting: %s\r\n       Got:%s",
-                      addr, stmp.toStdString().c_str(), sbuf.toStdString().c_str());
-            mStlink->runMCU();
-            emit sendLock(false);
-            return;
+                      addr + i, stmp.toStdString().c_str(), sbuf.toStdString().c_str());
+            return false;
         }
         oldprogress = progress;
-        progress = (i * 100) / file.size();
+        progress = ((done + i) * 100) / image.size();
         if (progress > oldprogress) { // Push only if number has increased
             emit sendProgress(progress);
             qInfo("Progress: %u%%", progress);
         }
-        emit sendStatus(tmp_str.asprintf("Verified %u/%lldKB", i / 1024, file.size() / 1024));
+        emit sendStatus(tmp_str.asprintf("Verified %lld/%lldKB", (done + i) / 1024, image.size() / 1024));
     }
-    file.close();
-    emit sendProgress(100);
-    emit sendStatus("Verification OK");
-    qInfo("Verification OK");
-    mStlink->runMCU();
-    emit sendLock(false);
+    return true;
 }